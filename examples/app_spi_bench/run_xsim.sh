@@ -0,0 +1,52 @@
+#!/bin/sh
+# Run every build config of app_spi_bench under xsim and collect one CSV.
+# usage: ./run_xsim.sh [bin dir] [output csv]
+
+BIN_DIR=${1:-bin}
+OUT=${2:-bench.csv}
+case "$(uname -s)" in
+    MINGW*|MSYS*|CYGWIN*) PLUGIN_EXT=dll ;;
+    Darwin) PLUGIN_EXT=dylib ;;
+    *) PLUGIN_EXT=so ;;
+esac
+PLUGIN=${LOOPBACK_PLUGIN:-LoopbackPort.$PLUGIN_EXT}
+# without NOP Bytes the slave can't turn a read around at the top SCK rates, those
+# rows are expected to fail up to this clk_div and show up as xfail
+NOP0_XFAIL_CLK_DIV=${NOP0_XFAIL_CLK_DIV:-4}
+
+# master sck -> slave sck and monitor sck, master mosi -> slave mosi,
+# slave miso -> master miso, master cs -> slave cs and monitor cs
+LOOPBACK="\
+-port tile[0] XS1_PORT_1A 1 0 -port tile[0] XS1_PORT_1E 1 0 \
+-port tile[0] XS1_PORT_1A 1 0 -port tile[0] XS1_PORT_1I 1 0 \
+-port tile[0] XS1_PORT_1C 1 0 -port tile[0] XS1_PORT_1F 1 0 \
+-port tile[0] XS1_PORT_1G 1 0 -port tile[0] XS1_PORT_1B 1 0 \
+-port tile[0] XS1_PORT_1D 1 0 -port tile[0] XS1_PORT_1H 1 0 \
+-port tile[0] XS1_PORT_1D 1 0 -port tile[0] XS1_PORT_1J 1 0"
+
+: > "$OUT.tmp"
+status=0
+for xe in "$BIN_DIR"/*/app_spi_bench_*.xe; do
+    echo "running $xe" >&2
+    if ! xsim --plugin "$PLUGIN" "$LOOPBACK" "$xe" > "$OUT.log"; then
+        echo "xsim failed on $xe" >&2
+        status=1
+    fi
+    grep -E '^(op|wr|rd),' "$OUT.log" >> "$OUT.tmp"
+done
+# every config prints the header
+awk -F, -v OFS=, -v max_div="$NOP0_XFAIL_CLK_DIV" '
+    $1 != "op" && $6 == 0 && $3 <= max_div && $NF == "fail" { $NF = "xfail" }
+    !seen[$0]++' "$OUT.tmp" > "$OUT"
+rm -f "$OUT.tmp" "$OUT.log"
+# every row past the header has to pass or be an expected failure, and there has to be one
+bad=$(awk -F, '$1 != "op" && $NF != "pass" && $NF != "xfail"' "$OUT" | wc -l)
+rows=$(grep -c -E '^(wr|rd),' "$OUT")
+if [ "$bad" -ne 0 ]; then
+    echo "$bad transfers read back wrong data, see $OUT" >&2
+    status=1
+elif [ "$rows" -eq 0 ]; then
+    echo "no results, see $OUT" >&2
+    status=1
+fi
+exit $status
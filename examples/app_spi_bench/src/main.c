@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xs1.h>
+#include <platform.h>
+#include <xcore/parallel.h>
+#include <xcore/channel.h>
+#include <xcore/port.h>
+#include <xcore/clock.h>
+#include "fast_spi.h"
+
+#ifndef SPI_MODE
+#define SPI_MODE 0
+#endif
+#ifndef NUM_NOP
+#define NUM_NOP 4
+#endif
+
+#define CPOL            (SPI_MODE >> 1)
+#define CPHA            (SPI_MODE & 1)
+#define HDR_LEN         (4 + NUM_NOP)
+#define MAX_LEN         640
+#define REPS            4       // back to back xfers per measurement, gives REPS-1 gaps
+#define MON_TICK_NS     10      // monitor ports sample at the 100MHz ref clock
+
+static const size_t xfer_lens[] = {1, 2, 3, 4, 5, 8, 16, 32, 64, 256, 640};
+static const uint32_t clk_divs[] = {0, 1, 2, 4, 8, 16};
+
+uint8_t __attribute__((aligned (4))) test_data[MAX_LEN];
+
+typedef struct {
+    uint32_t xfer;          // cs assert to cs deassert
+    uint32_t cs_to_sck;     // cs assert to first sck edge
+    uint32_t sck_to_cs;     // last sck edge to cs deassert
+    uint32_t gap;           // cs deassert to the next cs assert
+} bench_result_t;
+
+/*
+ * sck and cs of the master are looped back to p_sck and p_cs by the xsim port
+ * plugin, both ports sample at 100MHz in step. Every word holds 32 samples, the
+ * oldest in bit 0, so an edge shows up as a bit that differs from the one below.
+ */
+DECLARE_JOB(monitor_task, (chanend_t, port_t, port_t, xclock_t));
+void monitor_task(chanend_t c, port_t p_sck, port_t p_cs, xclock_t clk) {
+    clock_enable(clk);
+    clock_set_source_clk_ref(clk);
+    clock_set_divide(clk, 0);
+    port_start_buffered(p_sck, 32);
+    port_set_clock(p_sck, clk);
+    port_start_buffered(p_cs, 32);
+    port_set_clock(p_cs, clk);
+    clock_start(clk);
+
+    while (1) {
+        size_t reps = chan_in_word(c);
+
+        // line both ports up on the same sample
+        port_in(p_sck);
+        uint16_t t = port_get_trigger_time(p_sck) + 64;
+        port_clear_buffer(p_sck);
+        port_clear_buffer(p_cs);
+        port_set_trigger_time(p_sck, t);
+        port_set_trigger_time(p_cs, t);
+        uint32_t sck_prev = port_in(p_sck) >> 31;
+        uint32_t cs_prev = port_in(p_cs) >> 31;
+        chan_out_word(c, 0);   // armed, the master can start
+
+        uint32_t n = 32;        // samples before the current word
+        bool in_xfer = false;
+        bool have_sck = false;
+        uint32_t cs_on = 0, cs_off = 0, first = 0, last = 0;
+        bench_result_t sum = {0};
+        size_t done = 0;
+        while (done < reps) {
+            uint32_t s = port_in(p_sck);
+            uint32_t cs = port_in(p_cs);
+            if (s == 0u - sck_prev && cs == 0u - cs_prev) {
+                // nothing moved
+                n += 32;
+                continue;
+            }
+            uint32_t sck_edges = s ^ ((s << 1) | sck_prev);
+            uint32_t cs_edges = cs ^ ((cs << 1) | cs_prev);
+            sck_prev = s >> 31;
+            cs_prev = cs >> 31;
+            uint32_t from = 0;
+            while (1) {
+                uint32_t to = cs_edges ? __builtin_ctz(cs_edges) : 32;
+                uint32_t e = sck_edges & (~0u << from) & (to == 32 ? ~0u : (1u << to) - 1);
+                if (in_xfer && e) {
+                    if (!have_sck) {
+                        first = n + __builtin_ctz(e);
+                        have_sck = true;
+                    }
+                    last = n + 31 - __builtin_clz(e);
+                }
+                if (to == 32) {
+                    break;
+                }
+                if (!in_xfer) {
+                    cs_on = n + to;
+                    if (done > 0) {
+                        sum.gap += cs_on - cs_off;
+                    }
+                    have_sck = false;
+                } else {
+                    cs_off = n + to;
+                    if (!have_sck) {
+                        first = last = cs_on;
+                    }
+                    sum.xfer += cs_off - cs_on;
+                    sum.cs_to_sck += first - cs_on;
+                    sum.sck_to_cs += cs_off - last;
+                    ++done;
+                }
+                in_xfer = !in_xfer;
+                cs_edges &= cs_edges - 1;
+                from = to;
+            }
+            n += 32;
+        }
+
+        chan_out_word(c, sum.xfer / reps);
+        chan_out_word(c, sum.cs_to_sck / reps);
+        chan_out_word(c, sum.sck_to_cs / reps);
+        chan_out_word(c, reps > 1 ? sum.gap / (reps - 1) : 0);
+    }
+}
+
+static void monitor_start(chanend_t c_mon) {
+    chan_out_word(c_mon, REPS);
+    chan_in_word(c_mon);
+}
+
+static void monitor_result(chanend_t c_mon, bench_result_t* res) {
+    res->xfer = chan_in_word(c_mon) * MON_TICK_NS;
+    res->cs_to_sck = chan_in_word(c_mon) * MON_TICK_NS;
+    res->sck_to_cs = chan_in_word(c_mon) * MON_TICK_NS;
+    res->gap = chan_in_word(c_mon) * MON_TICK_NS;
+}
+
+static void print_row(const char* op, size_t len, uint32_t clk_div, bench_result_t* res, bool ok) {
+    // payload Bytes over the whole xfer period, header and gap included
+    uint32_t period = res->xfer + res->gap;
+    uint32_t kbps = period ? (uint32_t)((uint64_t)len * 1000000 / period) : 0;
+    printf("%s,%u,%u,%d,%d,%d,%u,%u,%u,%u,%u,%s\n",
+        op, len, clk_div, CPOL, CPHA, NUM_NOP,
+        res->xfer, kbps, res->cs_to_sck, res->sck_to_cs, res->gap,
+        ok ? "pass" : "fail"
+    );
+}
+
+DECLARE_JOB(bench_task, (chanend_t, fast_spi_master_device_handle_t*));
+void bench_task(chanend_t c_mon, fast_spi_master_device_handle_t* dev) {
+    uint8_t __attribute__((aligned (4))) tx_buf[HDR_LEN+MAX_LEN];
+    uint8_t __attribute__((aligned (4))) rx_buf[HDR_LEN+MAX_LEN];
+    bench_result_t wr, rd;
+    uint32_t lfsr = 0xACE1u;
+
+    local_thread_mode_set_bits(thread_mode_high_priority);
+
+    for (int i = 0; i < MAX_LEN; ++i) {
+        lfsr = (lfsr >> 1) ^ (-(lfsr & 1u) & 0xB400u);
+        test_data[i] = lfsr;
+    }
+
+    printf("op,len,clk_div,cpol,cpha,num_nop,xfer_ns,throughput_kBps,cs_to_sck_ns,sck_to_cs_ns,gap_ns,result\n");
+    for (int j = 0; j < sizeof(clk_divs) / sizeof(clk_divs[0]); ++j) {
+        fast_spi_master_set_clk_div(dev, clk_divs[j]);
+        fast_spi_master_init_xfer(dev);
+        for (int i = 0; i < sizeof(xfer_lens) / sizeof(xfer_lens[0]); ++i) {
+            size_t len = xfer_lens[i];
+
+            // write, tx only
+            memset(tx_buf, 0, HDR_LEN);
+            tx_buf[0] = 0x03;           // WR_DATA, address 0
+            memcpy(&tx_buf[HDR_LEN], test_data, len);
+            monitor_start(c_mon);
+            for (int r = 0; r < REPS; ++r) {
+                fast_spi_master_xfer(dev, tx_buf, NULL, HDR_LEN+len);
+            }
+            monitor_result(c_mon, &wr);
+
+            // read back, full duplex
+            memset(tx_buf, 0, HDR_LEN+len);
+            memset(rx_buf, 0, HDR_LEN+len);
+            tx_buf[0] = 0x04;           // RD_DATA, address 0
+            monitor_start(c_mon);
+            for (int r = 0; r < REPS; ++r) {
+                fast_spi_master_xfer(dev, tx_buf, rx_buf, HDR_LEN+len);
+            }
+            monitor_result(c_mon, &rd);
+
+            bool ok = memcmp(&rx_buf[HDR_LEN], test_data, len) == 0;
+            print_row("wr", len, clk_divs[j], &wr, ok);
+            print_row("rd", len, clk_divs[j], &rd, ok);
+        }
+    }
+    exit(0);
+}
+
+void main_tile0(chanend_t c_tile1, unsigned tile1_id)
+{
+    // spi master
+    port_t p_m_sclk  = XS1_PORT_1A;
+    port_t p_m_miso  = XS1_PORT_1B;
+    port_t p_m_mosi  = XS1_PORT_1C;
+    port_t p_m_cs    = XS1_PORT_1D;
+    xclock_t clk0    = XS1_CLKBLK_1;
+
+    // spi slave
+    port_t p_s_sclk  = XS1_PORT_1E;
+    port_t p_s_mosi  = XS1_PORT_1F;
+    port_t p_s_miso  = XS1_PORT_1G;
+    port_t p_s_ss    = XS1_PORT_1H;
+    xclock_t clk1    = XS1_CLKBLK_2;
+
+    // monitor, copies of master sck and cs
+    port_t p_mon_sclk = XS1_PORT_1I;
+    port_t p_mon_cs   = XS1_PORT_1J;
+    xclock_t clk2     = XS1_CLKBLK_3;
+
+    channel_t c_mon = chan_alloc();
+
+    fast_spi_master_handle_t spi_ctx;
+    fast_spi_master_device_handle_t spi_dev;
+    fast_spi_master_init(&spi_ctx, p_m_sclk, p_m_miso, p_m_mosi, p_m_cs, clk0, true);
+    fast_spi_master_device_init(&spi_ctx, &spi_dev, 0, CPOL, CPHA, fast_spi_clock_source_ref_clk, 0, fast_spi_data_mode_single);
+
+    fast_spi_slave_reg_handle_t spi_slave_handler;
+    uint8_t __attribute__((aligned (4))) reg_map[MAX_LEN];
+
+    PAR_JOBS(
+        PJOB(bench_task, (c_mon.end_a, &spi_dev)),
+        PJOB(monitor_task, (c_mon.end_b, p_mon_sclk, p_mon_cs, clk2)),
+        PJOB(fast_spi_slave_reg, (&spi_slave_handler, p_s_sclk, p_s_mosi, p_s_miso, p_s_ss, clk1, reg_map, MAX_LEN, CPOL, CPHA, NUM_NOP, 0, 0, fast_spi_frame_msb8))
+    );
+}
+
+void main_tile1(chanend_t c_tile0, unsigned tile0_id)
+{
+    // Do nothing here
+}
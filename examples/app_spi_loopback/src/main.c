@@ -123,15 +123,17 @@ void spi_master_task(fast_spi_master_handle_t* spi_ctx, fast_spi_master_device_h
             fast_spi_master_init_xfer(spi_master_dev);
             for (int i = 1; i <= 640; ++i) {
                 for (int k = 0; k < i; ++k) {
-                    // set reg data
-                    memset(rx_buf, 0, sizeof(rx_buf));
+                    // set reg data, header and payload straight from test_data
                     memset(tx_buf, 0, sizeof(tx_buf));
                     tx_buf[0] = 0x03;           // WR_DATA
                     tx_buf[1] = k & 0xFF;       // Address
                     tx_buf[2] = (k>>8) & 0xFF;
                     tx_buf[3] = (k>>16) & 0xFF;
-                    memcpy(&tx_buf[4+NUM_NOP], test_data, i-k);
-                    fast_spi_master_xfer(spi_master_dev, tx_buf, rx_buf, 4+NUM_NOP+(i-k));
+                    fast_spi_seg_t segs[2] = {
+                        {tx_buf, NULL, 4+NUM_NOP},
+                        {test_data, NULL, i-k}
+                    };
+                    fast_spi_master_xfer_sg(spi_master_dev, segs, 2);
                     // printf("s%d\n",4+NUM_NOP+(i-k));
                     // delay_microseconds(100);
                     // read reg data
@@ -182,14 +184,14 @@ void main_tile0(chanend_t c_tile1, unsigned tile1_id)
     fast_spi_master_handle_t spi_ctx;
     fast_spi_master_device_handle_t spi_dev;
     fast_spi_master_init(&spi_ctx, p_m_sclk, p_m_miso, p_m_mosi, p_m_cs, clk0, true);
-    fast_spi_master_device_init(&spi_ctx, &spi_dev, 0, 0, 0, fast_spi_clock_source_ref_clk, 0);
+    fast_spi_master_device_init(&spi_ctx, &spi_dev, 0, 0, 0, fast_spi_clock_source_ref_clk, 0, fast_spi_data_mode_single);
     
     fast_spi_slave_reg_handle_t spi_slave_handler;
     uint8_t __attribute__((aligned (4))) reg_map[640];
 
     PAR_JOBS(
         PJOB(spi_master_task, (&spi_ctx, &spi_dev)),
-        PJOB(fast_spi_slave_reg, (&spi_slave_handler, p_s_sclk, p_s_mosi, p_s_miso, p_s_ss, clk1, reg_map, 640, 0, 0, NUM_NOP, 0))
+        PJOB(fast_spi_slave_reg, (&spi_slave_handler, p_s_sclk, p_s_mosi, p_s_miso, p_s_ss, clk1, reg_map, 640, 0, 0, NUM_NOP, 0, 0, fast_spi_frame_msb8))
     );
 }
 
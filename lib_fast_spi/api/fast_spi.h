@@ -6,8 +6,78 @@
 #include <platform.h>
 #include <xcore/parallel.h>
 #include <xcore/channel.h>
+#include <xcore/channel_streaming.h>
 #include <xcore/port.h>
 #include <xcore/clock.h>
+#include <xcore/hwtimer.h>
+
+#ifndef FAST_SPI_LIST_GAP_TICKS
+#define FAST_SPI_LIST_GAP_TICKS 64  // CS high time between list entries, in port clock ticks (2 ticks per SCK cycle)
+#endif
+
+#ifndef FAST_SPI_SG_GAP_TICKS
+#define FAST_SPI_SG_GAP_TICKS 32    // SCK idle time between segments of one CS window, in port clock ticks
+#endif
+
+#ifndef FAST_SPI_SERVER_QUEUE_LEN
+#define FAST_SPI_SERVER_QUEUE_LEN 4         // outstanding xfers per local client, power of 2, at most 8
+#endif
+
+#ifndef FAST_SPI_SERVER_MAX_CLIENTS
+#define FAST_SPI_SERVER_MAX_CLIENTS 8       // local clients
+#endif
+
+#ifndef FAST_SPI_SERVER_MAX_REMOTE
+#define FAST_SPI_SERVER_MAX_REMOTE 2        // remote clients, each one has at most 1 xfer in flight
+#endif
+
+#ifndef FAST_SPI_SERVER_REMOTE_MAX_LEN
+#define FAST_SPI_SERVER_REMOTE_MAX_LEN 256  // Bytes per remote xfer
+#endif
+
+#ifndef FAST_SPI_SERVER_MAX_BATCH
+#define FAST_SPI_SERVER_MAX_BATCH 8         // xfers to the current device in a row while other devices wait
+#endif
+
+#ifndef FAST_SPI_CAL_CACHE_LEN
+#define FAST_SPI_CAL_CACHE_LEN 4    // calibrated dividers remembered per device
+#endif
+
+#ifndef FAST_SPI_CAL_MAX_EXTRA
+#define FAST_SPI_CAL_MAX_EXTRA 6    // miso sample point sweep, in port clock ticks after the earliest one
+#endif
+
+#ifndef FAST_SPI_CAL_MAX_PAD_DELAY
+#define FAST_SPI_CAL_MAX_PAD_DELAY 4    // miso pad delay sweep, in core clock cycles
+#endif
+
+#ifndef FAST_SPI_CAL_REPEAT
+#define FAST_SPI_CAL_REPEAT 4       // xfers a sample point has to get right
+#endif
+
+#ifndef FAST_SPI_REG_CACHE_MAX_GAP
+#define FAST_SPI_REG_CACHE_MAX_GAP 4    // clean Bytes a flush writes again to merge 2 dirty runs into one burst
+#endif
+
+#ifndef FAST_SPI_SCHED_LEAD_TICKS
+#define FAST_SPI_SCHED_LEAD_TICKS 500   // scheduler wakes up this long before an xfer is due, in reference clock ticks
+#endif
+
+#ifndef FAST_SPI_ASYNC_LEAD_CLKS
+#define FAST_SPI_ASYNC_LEAD_CLKS 600    // core clock cycles an async xfer leaves the interrupt to queue the next word
+#endif
+
+#ifndef FAST_SPI_LANES_ISSUE_CLKS
+#define FAST_SPI_LANES_ISSUE_CLKS 5     // core clock cycles per instruction slot of the lanes core, more above 5 busy cores
+#endif
+
+#ifndef FAST_SPI_MAX_CMD_LEN
+#define FAST_SPI_MAX_CMD_LEN 8      // command + address Bytes of a dual/quad transfer
+#endif
+
+#ifndef FAST_SPI_FLASH_POLL_TICKS
+#define FAST_SPI_FLASH_POLL_TICKS 1000  // pause between status reads of fast_spi_flash_wait, in reference clock ticks
+#endif
 
 typedef struct fast_spi_xfer {
     size_t dev_id;
@@ -16,11 +86,67 @@ typedef struct fast_spi_xfer {
     size_t len;
 } fast_spi_xfer_t;
 
+typedef struct fast_spi_seg {
+    const uint8_t* tx_buf;  // NULL clocks out zeros
+    uint8_t* rx_buf;        // NULL drops the input
+    size_t len;
+} fast_spi_seg_t;
+
 typedef enum fast_spi_clock_source {
     fast_spi_clock_source_core_clk,
     fast_spi_clock_source_ref_clk
 } fast_spi_clock_source_t;
 
+// FAST_SPI_STATS=1 keeps per device and per slave counters, without it none of the stats code is compiled in. The
+// stats fields are there either way, struct layouts don't depend on it. The inline FAST_SPI_XFER_FIXED counts as
+// well, so set it as the FAST_SPI_STATS cmake variable of the app, lib_build_info.cmake passes it to the app and
+// the library alike, rather than as a compiler flag of one of them
+#ifndef FAST_SPI_STATS
+#define FAST_SPI_STATS 0
+#endif
+
+typedef struct {
+    uint32_t xfers;
+    uint32_t rejects;       // slave only, transactions dropped for an unknown command or an address out of reg_map
+    uint32_t min_ticks;     // xfer time in reference clock ticks
+    uint32_t max_ticks;
+    uint64_t bytes;
+    uint64_t total_ticks;   // average xfer time is total_ticks / xfers
+} fast_spi_stats_t;
+
+// CRC in the usual poly/init/reflect/xorout terms, over the bits in the order they are on the wire: with msb8
+// framing the reflect false ones match the Bytes, with lsb framing the reflect true ones
+typedef struct {
+    uint32_t poly;      // MSB first, without the top bit
+    uint32_t init;
+    uint32_t xorout;
+    uint8_t width;      // 8, 16 or 32
+    bool reflect;       // refin and refout
+} fast_spi_crc_t;
+
+#define FAST_SPI_CRC8_SMBUS     {0x07, 0x00, 0x00, 8, false}
+#define FAST_SPI_CRC16_CCITT    {0x1021, 0xFFFF, 0x0000, 16, false}
+#define FAST_SPI_CRC32_MPEG2    {0x04C11DB7, 0xFFFFFFFF, 0x00000000, 32, false}
+#define FAST_SPI_CRC32          {0x04C11DB7, 0xFFFFFFFF, 0xFFFFFFFF, 32, true}
+
+// fast_spi_master_xfer_crc flags, the CRC takes the last width/8 Bytes of the buffer, MSB first unless reflect
+#define FAST_SPI_CRC_APPEND     0x1     // tx_buf gets the CRC of the Bytes before it
+#define FAST_SPI_CRC_CHECK      0x2     // rx_buf has to end in the CRC of the Bytes before it
+
+typedef enum fast_spi_data_mode {
+    fast_spi_data_mode_single,
+    fast_spi_data_mode_dual,    // SIO0, SIO1
+    fast_spi_data_mode_quad     // SIO0 - SIO3
+} fast_spi_data_mode_t;
+
+// bit order on the wire and word width buffers are made of, words are little endian in memory
+typedef enum fast_spi_frame {
+    fast_spi_frame_msb8,    // MSB first Bytes, the default
+    fast_spi_frame_msb16,   // MSB first 16 bit words, xfer_len and addresses a multiple of 2
+    fast_spi_frame_msb32,   // MSB first 32 bit words, xfer_len and addresses a multiple of 4
+    fast_spi_frame_lsb      // LSB first, any word width, buffers go out the way they are in memory
+} fast_spi_frame_t;
+
 typedef struct {
     port_t p_sck;
     port_t p_miso;
@@ -29,10 +155,31 @@ typedef struct {
     xclock_t clk_blk;
     fast_spi_clock_source_t clk_src;
     unsigned clk_divider;
-    uint32_t idle_clk_pattern;
+    bool sck_invert;
     uint32_t cs_deassert_pattern;
+    port_t p_sio;                       // 4-bit port sharing pins with mosi/miso, 0 if not used
+    fast_spi_data_mode_t data_mode;     // mode the ports are currently set up for
+    xclock_t shared_clk_blk;            // clk_blk passed to fast_spi_master_init, clk_src and clk_divider describe this one
+    uint32_t miso_pad_delay;            // pad delay miso is currently set up with
+    uint32_t switch_ticks;              // duration of the last fast_spi_master_init_xfer, in reference clock ticks
+    uint32_t max_switch_ticks;
 } fast_spi_master_handle_t;
 
+#define FAST_SPI_FIXED_MAX_LEN 8
+
+typedef unsigned (*fast_spi_fixed_kernel_t)(
+    port_t p_sck, port_t p_miso, port_t p_mosi, port_t p_cs, xclock_t clk_blk,
+    const uint8_t* tx_buf, uint8_t* rx_buf, size_t input_delay,
+    uint32_t clk_pattern, uint32_t finish_cs_pattern, uint32_t idle_clk_pattern
+);
+
+typedef struct {
+    bool valid;
+    uint32_t clk_divider;
+    uint8_t extra;          // sample point in port clock ticks after the earliest one
+    uint8_t pad_delay;
+} fast_spi_cal_t;
+
 typedef struct {
     fast_spi_master_handle_t* master;
     unsigned cs_bit_mask;
@@ -42,8 +189,45 @@ typedef struct {
     uint32_t idle_clk_pattern;
     size_t input_delay_1B;
     size_t input_delay;
+    fast_spi_data_mode_t data_mode;
+    fast_spi_frame_t frame;
+    const fast_spi_fixed_kernel_t* fixed_kernels;   // the FAST_SPI_FIXED_MAX_LEN kernels of frame, by length - 1
+    xclock_t clk_blk;       // clock block the ports run from for this device
+    bool own_clk_blk;       // clk_blk keeps this device's source and divider, switching only re-routes the ports
+    bool sck_invert;        // CPOL=1 runs as an inverted CPOL=0 sck
+    uint32_t miso_pad_delay;
+    uint32_t tick_core_clks;    // port clock tick in core clock cycles, at least 1
+    fast_spi_cal_t cal[FAST_SPI_CAL_CACHE_LEN];
+    size_t cal_next;            // cache entry the next new divider replaces
+    fast_spi_stats_t stats; // a fast_spi_master_xfer_list entry counts with its share of the time of its run
 } fast_spi_master_device_handle_t;
 
+typedef struct {
+    uint8_t* reg;       // what the host reads
+    uint8_t* mirror;    // host writes land here as well, the other bank
+} fast_spi_slave_reg_bank_t;
+
+typedef struct {
+    fast_spi_slave_reg_bank_t* volatile cur;    // bank the next transaction starts on
+    uint8_t* volatile in_use;                   // reg of the ongoing transaction, NULL between transactions
+    fast_spi_slave_reg_bank_t bank[2];
+    volatile size_t fast_rd;                    // reg_map offset RD_FAST reads from, read at every CS assert
+} fast_spi_slave_reg_banks_t;
+
+// what the host may do with a region of reg_map, see fast_spi_slave_reg_set_regions
+typedef enum fast_spi_slave_policy {
+    fast_spi_slave_policy_rw,
+    fast_spi_slave_policy_ro,
+    fast_spi_slave_policy_wo,
+    fast_spi_slave_policy_w1c   // read-write, a bit written as 1 clears that bit, one written as 0 leaves it
+} fast_spi_slave_policy_t;
+
+typedef struct {
+    size_t start;   // reg_map offset
+    size_t len;
+    fast_spi_slave_policy_t policy;
+} fast_spi_slave_region_t;
+
 typedef struct {
     port_t p_sck;
     port_t p_miso;
@@ -52,10 +236,75 @@ typedef struct {
     xclock_t clk_blk;
     uint32_t cs_val;
     uint32_t nop_cycle;
+    size_t miso_offset;
+    chanend_t c_notify;
+    fast_spi_frame_t frame;
     void* reg_map;
     size_t reg_map_len;
+    fast_spi_slave_reg_banks_t banks;
+    uint8_t* shadow;    // application side copy, committed by fast_spi_slave_update_reg
+    fast_spi_crc_t crc;
+    volatile uint32_t crc_state[3]; // poly, init and CRC of the last write as spi_slave_reg_xfer runs them
+    const uint32_t* volatile region_map;    // region table spi_slave_reg_xfer reads at every CS assert
+    uint32_t region_all[2];                 // the table of one read-write region over all of reg_map
+    fast_spi_stats_t stats; // from the first command word to CS high, reads count the Bytes queued on miso
 } fast_spi_slave_reg_handle_t;
 
+// rings hold a power of 2 number of words, heads and tails are free running word counts
+typedef struct {
+    uint32_t* rx_buf;               // mosi words, as clocked in
+    uint32_t rx_mask;               // number of rx_buf words - 1
+    volatile uint32_t rx_head;      // advanced by the slave
+    volatile uint32_t rx_tail;      // advanced by fast_spi_slave_stream_read
+    uint32_t* tx_buf;               // miso words, NULL to send zeros
+    uint32_t tx_mask;               // number of tx_buf words - 1
+    volatile uint32_t tx_head;      // advanced by fast_spi_slave_stream_write
+    volatile uint32_t tx_tail;      // advanced by the slave once a word is clocked out whole
+    volatile uint32_t rx_overrun;   // mosi words dropped as rx_buf was full
+    volatile uint32_t tx_underrun;  // zero words sent as tx_buf was empty
+    volatile uint32_t rx_partial;   // Bytes dropped at the end of transactions not a multiple of 4 Bytes long
+    volatile uint32_t tx_dropped;   // tx_buf words partly clocked out when CS went high, not sent again
+} fast_spi_slave_stream_t;
+
+// per Byte state of a register cache
+#define FAST_SPI_REG_VALID      0x1     // shadow holds what the slave has
+#define FAST_SPI_REG_DIRTY      0x2     // written to shadow, not to the slave yet
+#define FAST_SPI_REG_VOLATILE   0x4     // the slave changes it, reads always go to the slave
+
+typedef struct {
+    fast_spi_master_device_handle_t* dev;
+    uint8_t* shadow;        // remote reg_map as far as it is known
+    uint8_t* flags;         // FAST_SPI_REG_* of every shadow Byte
+    size_t len;
+    size_t num_nop;         // NOP Bytes the slave takes after the address
+    uint32_t* buf;          // header and data of one xfer
+    size_t hdr_words;       // words of buf taken by the header
+    size_t max_burst;       // data Bytes per xfer
+    size_t dirty_lo;        // dirty Bytes are all in [dirty_lo, dirty_hi)
+    size_t dirty_hi;
+    uint32_t xfers;         // xfers issued to the slave
+} fast_spi_reg_cache_t;
+
+#define FAST_SPI_FLASH_PAGE_LEN 256
+
+typedef struct {
+    fast_spi_master_device_handle_t* dev;   // single data mode, msb8
+    fast_spi_master_device_handle_t* wide;  // same CS in dual or quad data mode, NULL if there is none
+    uint8_t jedec_id[3];    // manufacturer, memory type, capacity
+    size_t size;            // Bytes
+    uint8_t read_cmd;       // 0x0B, 0x3B or 0x6B, 0xEB in continuous mode
+    bool continuous;        // quad reads use 0xEB and leave the flash in continuous read mode
+    bool in_continuous;     // the flash takes the next read without command Byte
+    bool busy;              // a program or erase was started and not seen finished yet
+    uint32_t page[FAST_SPI_FLASH_PAGE_LEN / 4]; // word aligned copy of a program source that isn't
+} fast_spi_flash_t;
+
+// min_ticks starts at UINT32_MAX, the counters are updated by the xfer core without locking
+void fast_spi_stats_reset(fast_spi_stats_t* stats);
+#if FAST_SPI_STATS
+// one more xfer of len Bytes that took ticks reference clock ticks
+void fast_spi_stats_add(fast_spi_stats_t* stats, size_t len, uint32_t ticks);
+#endif
 void fast_spi_master_init(fast_spi_master_handle_t* handle, port_t p_sck, port_t p_miso, port_t p_mosi, port_t p_cs, xclock_t clk_blk, bool cs_assert_low);
 void fast_spi_master_device_init(
     fast_spi_master_handle_t* master,
@@ -63,13 +312,292 @@ void fast_spi_master_device_init(
     uint32_t cs_pin,
     uint8_t cpol, uint8_t cpha,
     fast_spi_clock_source_t source_clk,
-    uint32_t clk_divider
+    uint32_t clk_divider,
+    fast_spi_data_mode_t data_mode
 );
+// dual/quad devices need the 4-bit port wired to SIO0 (mosi) - SIO3
+void fast_spi_master_init_sio(fast_spi_master_handle_t* handle, port_t p_sio);
+// give the device a clock block of its own, so switching to it needs no clock reconfiguration
+void fast_spi_master_device_set_clk_blk(fast_spi_master_device_handle_t* handle, xclock_t clk_blk);
 void fast_spi_master_set_clk_div(fast_spi_master_device_handle_t* handle, uint32_t clk_divider);
+// fast_spi_master_xfer, FAST_SPI_XFER_FIXED, _crc, the async xfer and the server take the frame, list, sg, lanes
+// and the scheduler only do msb8 and refuse a device set to anything else
+void fast_spi_master_device_set_frame(fast_spi_master_device_handle_t* handle, fast_spi_frame_t frame);
 void fast_spi_master_init_xfer(fast_spi_master_device_handle_t* handle);
-void fast_spi_master_xfer(fast_spi_master_device_handle_t* handle, uint8_t* tx_buf, uint8_t* rx_buf, size_t xfer_len);
+/*
+ * Sweep the miso sample point (port time and pad delay) at the current divider, tx_buf has to make the device
+ * answer with expected from Byte check_from on. The centre of the longest run of good sample points is kept and
+ * cached for the divider, fast_spi_master_set_clk_div picks it up again. Returns false and keeps the nominal
+ * sample point when none is good. Single data mode only. Every 1-bit xfer function takes the sample point of its
+ * device, fast_spi_master_xfer_list starts a new run where it changes. The scheduler keeps the pad delay of its
+ * first device for all of them, fast_spi_sched_init refuses devices calibrated to a different one.
+ */
+bool fast_spi_master_calibrate(
+    fast_spi_master_device_handle_t* handle,
+    uint8_t* tx_buf, uint8_t* rx_buf, size_t xfer_len,
+    const uint8_t* expected, size_t check_from
+);
+// tx_buf NULL holds mosi low (read only), rx_buf NULL skips miso (write only). Returns false and sends nothing
+// with both NULL, xfer_len 0 or for a dual/quad device, the same goes for the other 1-bit xfer functions and
+// FAST_SPI_XFER_FIXED
+bool fast_spi_master_xfer(fast_spi_master_device_handle_t* handle, uint8_t* tx_buf, uint8_t* rx_buf, size_t xfer_len);
+
+/*
+ * Straight-line full duplex kernels for 1 - FAST_SPI_FIXED_MAX_LEN Bytes, fast_spi_master_xfer dispatches to them
+ * by length. FAST_SPI_XFER_FIXED calls the kernel of a literal len from the fixed_kernels of the device in an
+ * inline wrapper and skips that dispatch as well: FAST_SPI_XFER_FIXED(dev, 3, tx_buf, rx_buf). Both buffers word
+ * aligned and not NULL.
+ */
+static inline bool fast_spi_master_xfer_fixed(
+    fast_spi_master_device_handle_t* handle, fast_spi_fixed_kernel_t kernel,
+    const uint8_t* tx_buf, uint8_t* rx_buf, size_t xfer_len
+) {
+    if (handle->data_mode != fast_spi_data_mode_single) {
+        return false;
+    }
+#if FAST_SPI_STATS
+    uint32_t stats_start = get_reference_time();
+#endif
+    port_out(handle->master->p_cs, handle->cs_bit_mask);
+    kernel(
+        handle->master->p_sck,
+        handle->master->p_miso,
+        handle->master->p_mosi,
+        handle->master->p_cs,
+        handle->master->clk_blk,
+        tx_buf, rx_buf,
+        xfer_len == 1 ? handle->input_delay_1B : handle->input_delay,
+        handle->clk_pattern, handle->master->cs_deassert_pattern,
+        handle->idle_clk_pattern
+    );
+#if FAST_SPI_STATS
+    fast_spi_stats_add(&handle->stats, xfer_len, get_reference_time() - stats_start);
+#endif
+    return true;
+}
 
-DECLARE_JOB(fast_spi_slave_reg, (fast_spi_slave_reg_handle_t*, port_t, port_t, port_t, port_t, xclock_t, void*, size_t, int, int, size_t, size_t));
+// one wrapper per len, anything but a literal 1 - FAST_SPI_FIXED_MAX_LEN doesn't compile
+#define FAST_SPI_FIXED_WRAPPER(len) \
+    static inline bool fast_spi_master_xfer_fixed_##len( \
+        fast_spi_master_device_handle_t* handle, const uint8_t* tx_buf, uint8_t* rx_buf \
+    ) { \
+        return fast_spi_master_xfer_fixed(handle, handle->fixed_kernels[len - 1], tx_buf, rx_buf, len); \
+    }
+FAST_SPI_FIXED_WRAPPER(1)
+FAST_SPI_FIXED_WRAPPER(2)
+FAST_SPI_FIXED_WRAPPER(3)
+FAST_SPI_FIXED_WRAPPER(4)
+FAST_SPI_FIXED_WRAPPER(5)
+FAST_SPI_FIXED_WRAPPER(6)
+FAST_SPI_FIXED_WRAPPER(7)
+FAST_SPI_FIXED_WRAPPER(8)
+
+#define FAST_SPI_XFER_FIXED(dev, len, tx_buf, rx_buf) \
+    fast_spi_master_xfer_fixed_##len((dev), (tx_buf), (rx_buf))
+
+// xfers[i].dev_id indexes devices, entries run back to back with the clock block kept running. The clock block
+// only stops where the next device has a different bus config or sample point. Single data mode msb8 devices
+// only, returns false and sends nothing if any entry is for another one
+bool fast_spi_master_xfer_list(fast_spi_master_device_handle_t** devices, fast_spi_xfer_t* xfers, size_t num_xfers);
+// all segments go out under one CS assertion, SCK pauses for FAST_SPI_SG_GAP_TICKS between segments, msb8 only.
+// Every segment needs len > 0 and word aligned (or NULL) buffers, returns false and sends nothing otherwise: a
+// payload that isn't aligned has to be copied to one that is first, as fast_spi_flash_program does with page
+bool fast_spi_master_xfer_sg(fast_spi_master_device_handle_t* handle, fast_spi_seg_t* segs, size_t num_segs);
+/*
+ * fast_spi_master_xfer (full duplex, both buffers required) with the CRC of both directions. From 10 Bytes on the
+ * burst word loop takes it while the data is on the bus, the first tx word and the last 6 - 9 Bytes are done in
+ * software afterwards, shorter xfers are all software. FAST_SPI_CRC_APPEND is not accelerated: the CRC has to be
+ * in tx_buf before the last Bytes go out, so the tx CRC is a crc32 pass over tx_buf before the xfer and only rx is
+ * taken on the bus. tx_crc and rx_crc (NULL if not needed) get the CRC of everything before the trailing CRC with
+ * the matching flag set, of the whole buffer without. Returns false when FAST_SPI_CRC_CHECK finds a mismatch, or
+ * without sending anything for a dual/quad device or an xfer_len no longer than the CRC with a flag set.
+ */
+bool fast_spi_master_xfer_crc(
+    fast_spi_master_device_handle_t* handle, const fast_spi_crc_t* crc,
+    uint8_t* tx_buf, uint8_t* rx_buf, size_t xfer_len,
+    unsigned flags, uint32_t* tx_crc, uint32_t* rx_crc
+);
+/*
+ * Multi-lane master: fast_spi_master_init with 4-bit p_miso and p_mosi gives FAST_SPI_LANES devices sharing SCK
+ * and CS, lane n on bit n of both ports, and fast_spi_master_xfer_lanes moves xfer_len Bytes on every lane in the
+ * bus time one device takes at the same SCK. tx_buf and rx_buf (both required) hold the lanes back to back,
+ * uint8_t buf[FAST_SPI_LANES][xfer_len]. msb8 framing, single data mode. The kernel transposes a Byte of every
+ * lane per 8 SCK cycles (16 port clock ticks) in 40 instruction slots, and miso keeps sampling if the core falls
+ * behind, so SCK is capped well below the 1-bit kernels: a port clock tick has to be at least
+ * 40 * FAST_SPI_LANES_ISSUE_CLKS / 16 core clock cycles, 13 by default, which is clk_div 2 off a 100MHz reference
+ * clock on a 600MHz core. The 1-bit xfer functions and calibration don't apply to it. Returns false and sends
+ * nothing for a faster divider, xfer_len 0 or a dual/quad or framed device.
+ */
+#define FAST_SPI_LANES 4
+bool fast_spi_master_xfer_lanes(fast_spi_master_device_handle_t* handle, uint8_t* tx_buf, uint8_t* rx_buf, size_t xfer_len);
+// cmd_buf goes out 1-bit on SIO0, data_len Bytes of tx_buf or rx_buf (rx_buf takes priority) in the device data mode
+// dummy_cycles must be a multiple of 4 and only apply to reads, quad data_len must be even, 1 <= cmd_len <=
+// FAST_SPI_MAX_CMD_LEN. Returns false and sends nothing otherwise, or for a single mode device or no sio port
+bool fast_spi_master_xfer_wide(
+    fast_spi_master_device_handle_t* handle,
+    uint8_t* cmd_buf, size_t cmd_len,
+    size_t dummy_cycles,
+    uint8_t* tx_buf, uint8_t* rx_buf, size_t data_len
+);
+// fast_spi_master_xfer_wide with addr_buf (address and mode Bytes) in the device data mode after the 1-bit cmd_buf,
+// as 0xBB/0xEB reads take it, cmd_len may be 0, 1 <= cmd_len + addr_len <= FAST_SPI_MAX_CMD_LEN, quad addr_len
+// even. Returns false and sends nothing otherwise, or for what fast_spi_master_xfer_wide rejects
+bool fast_spi_master_xfer_wide_io(
+    fast_spi_master_device_handle_t* handle,
+    const uint8_t* cmd_buf, size_t cmd_len,
+    const uint8_t* addr_buf, size_t addr_len,
+    size_t dummy_cycles,
+    uint8_t* tx_buf, uint8_t* rx_buf, size_t data_len
+);
+
+typedef struct {
+    streaming_channel_t c_done; // the interrupt sends a word on end_a when the xfer is done, end_b can go in a SELECT
+    fast_spi_master_device_handle_t* handle;
+    const uint32_t* tx_buf;
+    uint32_t* rx_buf;
+    size_t len;
+    size_t num_words;       // port words of the xfer, 2 Bytes each
+    size_t word;            // port word the next interrupt takes in
+    uint32_t tx_word;       // tx buffer word in port order
+    uint32_t rx_word;       // rx buffer word in port order, as far as it came in
+    uint16_t time;          // port time of the first tick of the current port word
+    uint16_t step;          // port clock ticks from one port word to the next
+    uint32_t stats_start;
+    bool busy;
+} fast_spi_master_async_t;
+
+/*
+ * fast_spi_master_xfer_start returns once the first 2 Bytes are queued, the rest runs from p_miso interrupts on
+ * the calling core, one per 2 Bytes, so no core of its own is needed. That core runs from a function declared
+ * with DEFINE_INTERRUPT_PERMITTED(fast_spi_master_irq, ...) and called through INTERRUPT_PERMITTED(), and must
+ * not wait on events itself, the same as for fast_spi_slave_reg_irq_start. Every 2 Bytes (32 port clock ticks)
+ * take the input delay plus FAST_SPI_ASYNC_LEAD_CLKS worth of port clock ticks, SCK stretches in between. With
+ * the default lead and a 100MHz port clock on a 600MHz core that is about 134 ticks per 32, a quarter of the
+ * throughput of fast_spi_master_xfer or about 1.5MB/s, the share gets better as SCK slows down. The lead covers
+ * the interrupt entry and the ~100 instructions of the handler, an interrupt later than that costs a port timer
+ * wrap of SCK pause, the data stays right. Raise it if other interrupts on the core can hold this one up.
+ * Single data mode, p_miso is required.
+ */
+void fast_spi_master_async_init(fast_spi_master_async_t* ctx);
+// buffers word aligned and untouched until fast_spi_master_xfer_wait, fast_spi_master_init_xfer must not run in between
+void fast_spi_master_xfer_start(fast_spi_master_async_t* ctx, fast_spi_master_device_handle_t* handle, uint8_t* tx_buf, uint8_t* rx_buf, size_t xfer_len);
+void fast_spi_master_xfer_wait(fast_spi_master_async_t* ctx);
+void fast_spi_master_async_stop(fast_spi_master_async_t* ctx);
+
+typedef struct {
+    fast_spi_xfer_t ring[FAST_SPI_SERVER_QUEUE_LEN];
+    volatile uint32_t head;     // written by the client only
+    volatile uint32_t done;     // written by the server only
+    uint32_t acked;             // completions taken from c
+    chanend_t c;                // one END token per completed xfer, ready to SELECT on
+} fast_spi_client_t;
+
+typedef struct {
+    chanend_t c;
+    size_t num_devices;
+} fast_spi_remote_client_t;
+
+typedef struct {
+    chanend_t reply_to;
+    size_t dev_id;
+    bool has_tx;
+    bool has_rx;
+    size_t len;
+    uint32_t tx_buf[(FAST_SPI_SERVER_REMOTE_MAX_LEN + 3) / 4];
+    uint32_t rx_buf[(FAST_SPI_SERVER_REMOTE_MAX_LEN + 3) / 4];
+} fast_spi_remote_slot_t;
+
+typedef struct {
+    chanend_t c_req;            // doorbells of local clients and requests of remote clients
+    chanend_t c_reply;
+    fast_spi_master_device_handle_t** devices;
+    size_t num_devices;
+    fast_spi_master_device_handle_t* current;
+    fast_spi_client_t* clients[FAST_SPI_SERVER_MAX_CLIENTS];
+    size_t num_clients;
+    fast_spi_remote_slot_t remote[FAST_SPI_SERVER_MAX_REMOTE];
+    size_t next;                // round robin start, clients first then remote slots
+    size_t batch;
+    volatile size_t queue_depth;
+    volatile size_t max_queue_depth;
+    volatile uint32_t device_switches;
+} fast_spi_master_server_t;
+
+// devices is indexed by dev_id, clients register with fast_spi_client_init before the server starts
+void fast_spi_master_server_init(fast_spi_master_server_t* srv, fast_spi_master_device_handle_t** devices, size_t num_devices);
+DECLARE_JOB(fast_spi_master_server, (fast_spi_master_server_t*));
+void fast_spi_master_server(fast_spi_master_server_t* srv);
+// false when the server has FAST_SPI_SERVER_MAX_CLIENTS already or no chanend is left
+bool fast_spi_client_init(fast_spi_client_t* client, fast_spi_master_server_t* srv);
+void fast_spi_client_xfer_start(fast_spi_client_t* client, size_t dev_id, uint8_t* tx_buf, uint8_t* rx_buf, size_t len);
+void fast_spi_client_xfer_wait(fast_spi_client_t* client);
+void fast_spi_client_xfer(fast_spi_client_t* client, size_t dev_id, uint8_t* tx_buf, uint8_t* rx_buf, size_t len);
+size_t fast_spi_client_queue_depth(fast_spi_client_t* client);
+// server_id is srv->c_req, passed over from the server tile, num_devices the same as for the server
+void fast_spi_remote_client_init(fast_spi_remote_client_t* client, chanend_t server_id, size_t num_devices);
+// false for a dev_id or len (1 to FAST_SPI_SERVER_REMOTE_MAX_LEN) either end rejects, waits while all remote slots are taken
+bool fast_spi_remote_client_xfer(fast_spi_remote_client_t* client, size_t dev_id, uint8_t* tx_buf, uint8_t* rx_buf, size_t len);
+
+typedef struct {
+    size_t dev_id;              // index into the devices of the scheduler
+    uint8_t* tx_buf;            // goes out every period, word aligned
+    uint8_t* rx_buf[2];         // filled in turns, word aligned, read them through fast_spi_sched_read
+    size_t len;
+    uint32_t period;            // reference clock ticks
+    uint32_t phase;             // first xfer this long after the scheduler starts
+    uint32_t due;               // next instant, kept by the scheduler
+    volatile uint32_t seq;      // xfers done, rx_buf[(seq - 1) & 1] has the latest one
+    volatile uint32_t time[2];  // reference time CS asserted at for the xfer in the matching rx_buf, +-1 tick
+    volatile uint32_t missed;   // instants dropped as the entry was more than a period behind
+} fast_spi_sched_entry_t;
+
+typedef struct {
+    fast_spi_master_device_handle_t** devices;
+    fast_spi_sched_entry_t* entries;
+    size_t num_entries;
+    chanend_t c_ctrl;
+    uint32_t ref_per_tick;      // reference clock ticks per port clock tick
+    uint32_t base;              // reference time of port time base_pt, moved along with every xfer
+    uint32_t base_pt;
+    volatile uint32_t late;     // xfers that missed their instant and went out as soon as possible instead
+    volatile uint32_t max_late_ticks;
+} fast_spi_sched_t;
+
+/*
+ * Periodic xfers at fixed instants. The clock block runs for as long as fast_spi_sched_task does, so port time
+ * stays locked to the reference clock and CS of every xfer is set to assert at the port time of its instant, the
+ * same way spi_master_list_xfer times list entries. The core only wakes up FAST_SPI_SCHED_LEAD_TICKS ahead, the
+ * instant itself does not depend on how long that took. Instants are rounded up to a port clock tick.
+ * All devices must share one bus config (clock block, reference clock source, divider, polarity, miso pad delay),
+ * single data mode and msb8. Returns false if they don't. Entries should not overlap on the bus, an xfer that can't start on time is late.
+ */
+bool fast_spi_sched_init(
+    fast_spi_sched_t* sched, fast_spi_master_device_handle_t** devices,
+    fast_spi_sched_entry_t* entries, size_t num_entries, chanend_t c_ctrl
+);
+// owns the bus and a logical core until fast_spi_sched_stop, c_ctrl is a streaming chanend. The core sleeps on
+// its timer between xfers, it is taken so the clock block and the port time stay locked to the reference clock
+DECLARE_JOB(fast_spi_sched_task, (fast_spi_sched_t*));
+void fast_spi_sched_task(fast_spi_sched_t* sched);
+// c is the other end of c_ctrl, returns once the scheduler has stopped the clock block
+void fast_spi_sched_stop(chanend_t c);
+// copies the latest rx_buf of entry to dst, returns its seq (0: none yet), time gets its instant if not NULL
+uint32_t fast_spi_sched_read(const fast_spi_sched_entry_t* entry, void* dst, uint32_t* time);
+
+/*
+ * Set up the handler before the slave starts and pass reg_map NULL to fast_spi_slave_reg afterwards. RD_FAST,
+ * CRC and regions start out at their defaults here, the start leaves them alone, so their setters can be called
+ * any time after this, before the slave starts as well.
+ */
+void fast_spi_slave_reg_init(fast_spi_slave_reg_handle_t* handler, void* reg_map, size_t reg_map_len);
+// the same for a double buffered reg_map: reg_map, reg_map_b and shadow start out as copies of reg_map
+void fast_spi_slave_reg_init_double_buffer(fast_spi_slave_reg_handle_t* handler, void* reg_map, void* reg_map_b, void* shadow, size_t reg_map_len);
+// CS has to stay high for about 10 thread cycles plus the event latency between transactions. The end of a write
+// is committed after p_mosi is ready for the next command, up to about 60 thread cycles more (see
+// spi_slave_reg_xfer.S), a read right after a write needs that in its CS high time, num_nop or RD_FAST lead time.
+// A reg_map that isn't NULL runs fast_spi_slave_reg_init on the slave core first, only for a slave using none of
+// the RD_FAST, CRC and region setters
+DECLARE_JOB(fast_spi_slave_reg, (fast_spi_slave_reg_handle_t*, port_t, port_t, port_t, port_t, xclock_t, void*, size_t, int, int, size_t, size_t, chanend_t, fast_spi_frame_t));
 void fast_spi_slave_reg(
     fast_spi_slave_reg_handle_t* handler,
     port_t p_sclk,
@@ -82,9 +610,145 @@ void fast_spi_slave_reg(
     int cpol,
     int cpha,
     size_t num_nop,
-    size_t miso_offset // set to non zero when clk to data timing can't match with desire clk rate, can't use when num_nop is not zero
+    size_t miso_offset, // set to non zero when clk to data timing can't match with desire clk rate, can't use when num_nop is not zero
+    chanend_t c_notify, // streaming chanend told about every completed write, 0 if not used
+    fast_spi_frame_t frame  // framing of the data, command and address stay msb8
+);
+// wait for the next completed write reported on the other end of c_notify
+void fast_spi_slave_reg_wait_write(chanend_t c, uint32_t* addr, size_t* len);
+// CRC of the data Bytes of every write, taken as they come in (wire order as for the master), off after the init
+// call
+void fast_spi_slave_reg_set_crc(fast_spi_slave_reg_handle_t* handler, const fast_spi_crc_t* crc);
+// CRC of the last write, read it once c_notify has reported the write
+uint32_t fast_spi_slave_reg_last_crc(fast_spi_slave_reg_handle_t* handler);
+/*
+ * Point the RD_FAST command (0x0B, no address, no NOP Bytes) at reg_map[addr], the host clocks the data right
+ * after the command Byte. The slave queues the first 7 Bytes at CS assert, so the host has to leave about 20
+ * thread cycles plus the event latency between CS assert and the first SCK edge, with fast_spi_slave_reg_irq_start
+ * the interrupt latency below instead. addr is word aligned with at least 12 Bytes of reg_map from it, false
+ * otherwise. Starts out at 0 after the init call.
+ */
+bool fast_spi_slave_reg_set_fast_rd(fast_spi_slave_reg_handle_t* handler, size_t addr);
+/*
+ * Access policies for regions of reg_map, looked up once per command in the decode. A read or write that starts
+ * outside what its region allows is rejected, one that runs past the end of its region is cut off there the same
+ * way as at the end of reg_map. Offsets in no region can be neither read nor written, RD_FAST is not checked.
+ * Regions start and end on word boundaries, the end of reg_map excepted. map holds the table the slave runs
+ * from, one word plus one per granule, the largest power of 2 every region boundary is a multiple of:
+ * (reg_map_len + 3) / 4 + 1 words are always enough. It has to stay valid and can't be the table in use.
+ * Returns false if a region is not aligned, overlaps another or runs past reg_map, or map is too short.
+ * num_regions 0 goes back to all of reg_map read-write, the state after the init call. Takes effect at the next
+ * CS assert.
+ */
+bool fast_spi_slave_reg_set_regions(
+    fast_spi_slave_reg_handle_t* handler, const fast_spi_slave_region_t* regions, size_t num_regions,
+    uint32_t* map, size_t map_len
 );
 
+/*
+ * fast_spi_slave_reg on interrupts: returns straight away and runs every transaction from the p_cs interrupt on
+ * the calling core, application code keeps the core while the bus is idle. The arguments are the same as for
+ * fast_spi_slave_reg.
+ *
+ * Code on that core runs from a function declared with DEFINE_INTERRUPT_PERMITTED(fast_spi_slave_irq, ...) and
+ * called through INTERRUPT_PERMITTED(). A transaction waits on the event unit, so that code must not wait on
+ * events (SELECT) itself, blocking port, channel and timer I/O is fine. It owns the core from CS assert to CS
+ * high.
+ *
+ * Worst case latency from CS assert to the kernel waiting for the command word is the longest stretch the core
+ * spends with interrupts masked plus about 60 thread cycles of interrupt entry and setup (0.5us at 120MIPS).
+ * It has to be shorter than 64 SCK cycles, p_mosi holds only the command word and the one after it. Reads
+ * need num_nop for the miso data the same as with fast_spi_slave_reg, RD_FAST needs that latency as CS lead time.
+ */
+void fast_spi_slave_reg_irq_start(
+    fast_spi_slave_reg_handle_t* handler,
+    port_t p_sclk,
+    port_t p_mosi,
+    port_t p_miso,
+    port_t p_cs,
+    xclock_t cb_clk,
+    void* reg_map,
+    size_t reg_map_len,
+    int cpol,
+    int cpha,
+    size_t num_nop,
+    size_t miso_offset,
+    chanend_t c_notify,
+    fast_spi_frame_t frame
+);
+// no new transaction starts after this, call it from the core that started the slave
+void fast_spi_slave_reg_irq_stop(fast_spi_slave_reg_handle_t* handler);
+// publish shadow[addr, addr+len) atomically, the host sees all of it or none of it, single caller at a time.
+// A host write to the range while this runs wins over shadow if it lands after the copy, both banks agree either
+// way, shadow isn't updated with it
 void fast_spi_slave_update_reg(fast_spi_slave_reg_handle_t* handler, uint32_t addr, size_t len);
 
-#endif
\ No newline at end of file
+// rx_buf and tx_buf word aligned with a power of 2 number of words, tx_buf NULL for receive only
+void fast_spi_slave_stream_init(fast_spi_slave_stream_t* stream, uint32_t* rx_buf, size_t rx_words, uint32_t* tx_buf, size_t tx_words);
+// no command or address, every mosi word goes to rx_buf, every miso word comes from tx_buf, p_miso is required
+DECLARE_JOB(fast_spi_slave_stream, (fast_spi_slave_stream_t*, port_t, port_t, port_t, port_t, xclock_t, int, int));
+void fast_spi_slave_stream(
+    fast_spi_slave_stream_t* stream,
+    port_t p_sclk,
+    port_t p_mosi,
+    port_t p_miso,
+    port_t p_cs,
+    xclock_t cb_clk,
+    int cpol,
+    int cpha
+);
+// single consumer, returns the number of words copied to words
+size_t fast_spi_slave_stream_read(fast_spi_slave_stream_t* stream, uint32_t* words, size_t max_words);
+// single producer, returns the number of words queued for the host
+size_t fast_spi_slave_stream_write(fast_spi_slave_stream_t* stream, const uint32_t* words, size_t num_words);
+
+/*
+ * Write-back cache of the reg_map of a slave speaking the fast_spi_slave_reg protocol (WR_DATA/RD_DATA, 24 bit
+ * address, num_nop NOP Bytes). Writes only land in shadow until fast_spi_reg_cache_flush, which sends every run
+ * of dirty Bytes as one burst and merges runs up to FAST_SPI_REG_CACHE_MAX_GAP clean Bytes apart when those are
+ * valid and not volatile. Reads of valid, non volatile Bytes never touch the bus, other reads flush first so the
+ * slave sees the accesses in program order. dev has to use msb8 framing.
+ *
+ * shadow and flags are len Bytes each, buf holds the 4 + num_nop header Bytes rounded up to a word and at least
+ * one word of data, the longest burst is whatever is left of buf_words. Nothing is valid after init.
+ */
+void fast_spi_reg_cache_init(
+    fast_spi_reg_cache_t* cache,
+    fast_spi_master_device_handle_t* dev,
+    uint8_t* shadow, uint8_t* flags, size_t len,
+    size_t num_nop,
+    uint32_t* buf, size_t buf_words
+);
+void fast_spi_reg_cache_set_volatile(fast_spi_reg_cache_t* cache, uint32_t addr, size_t len);
+void fast_spi_reg_cache_write(fast_spi_reg_cache_t* cache, uint32_t addr, const void* data, size_t len);
+void fast_spi_reg_cache_read(fast_spi_reg_cache_t* cache, uint32_t addr, void* data, size_t len);
+void fast_spi_reg_cache_flush(fast_spi_reg_cache_t* cache);
+// forget what the slave holds in [addr, addr+len), e.g. after it was reset, dirty Bytes stay dirty
+void fast_spi_reg_cache_invalidate(fast_spi_reg_cache_t* cache, uint32_t addr, size_t len);
+
+/*
+ * SPI NOR flash with 24 bit addresses on dev, reads go out as one burst straight into dst: 0x0B on dev, 0x3B or
+ * 0x6B on wide, 0xEB with continuous mode. Quad needs the QE bit of the flash set, which is vendor specific and
+ * left to the application. Program and erase return once the flash took the command, fast_spi_flash_poll tells
+ * when it is done without blocking, every other call waits for it first. dst and the buffers the kernels take
+ * have to be word aligned, program copies an unaligned src to page.
+ */
+// leaves continuous read mode, reads the JEDEC ID, false when no flash answers or the capacity is unknown
+bool fast_spi_flash_init(fast_spi_flash_t* flash, fast_spi_master_device_handle_t* dev, fast_spi_master_device_handle_t* wide);
+// quad only, returns false without a quad wide device
+bool fast_spi_flash_set_continuous(fast_spi_flash_t* flash, bool on);
+// false if [addr, addr+len) is not in the flash, the wide device can't take the read or dst isn't word aligned
+bool fast_spi_flash_read(fast_spi_flash_t* flash, uint32_t addr, uint8_t* dst, size_t len);
+// starts a page program up to the end of the page addr is in, returns the Bytes taken, 0 past the end
+size_t fast_spi_flash_program(fast_spi_flash_t* flash, uint32_t addr, const uint8_t* src, size_t len);
+// addr and len 4K aligned, the whole flash of a part up to 16MB is a chip erase, returns with the last block still
+// erasing
+bool fast_spi_flash_erase(fast_spi_flash_t* flash, uint32_t addr, size_t len);
+// true once the last program or erase is done
+bool fast_spi_flash_poll(fast_spi_flash_t* flash);
+// pauses the core FAST_SPI_FLASH_POLL_TICKS between status reads
+void fast_spi_flash_wait(fast_spi_flash_t* flash);
+// program page by page and wait for each, false if [addr, addr+len) is not in the flash
+bool fast_spi_flash_write(fast_spi_flash_t* flash, uint32_t addr, const uint8_t* src, size_t len);
+
+#endif
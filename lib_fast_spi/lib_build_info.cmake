@@ -2,4 +2,11 @@ set(LIB_NAME lib_fast_spi)
 set(LIB_VERSION 1.0.0)
 set(LIB_INCLUDES api)
 set(LIB_DEPENDENT_MODULES "")
+
+# FAST_SPI_STATS goes to the app sources as well, they inline FAST_SPI_XFER_FIXED
+if(NOT DEFINED FAST_SPI_STATS)
+    set(FAST_SPI_STATS 0)
+endif()
+add_compile_definitions(FAST_SPI_STATS=${FAST_SPI_STATS})
+
 XMOS_REGISTER_MODULE()
\ No newline at end of file
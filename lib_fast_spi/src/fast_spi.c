@@ -1,13 +1,96 @@
 #include "fast_spi.h"
+#include <stddef.h>
+#include <string.h>
 #include <xcore/port.h>
 #include <xcore/channel.h>
+#include <xcore/channel_streaming.h>
+#include <xcore/hwtimer.h>
 #include <xcore/select.h>
+#include <xcore/thread.h>
 #include <xcore/port.h>
 #include <xcore/port_protocol.h>
 #include <xcore/triggerable.h>
+#include <xcore/interrupt.h>
+#include <xcore/interrupt_wrappers.h>
 
 #define ASSERTED 1
 
+#if FAST_SPI_STATS
+void fast_spi_stats_add(fast_spi_stats_t* stats, size_t len, uint32_t ticks) {
+    ++stats->xfers;
+    stats->bytes += len;
+    stats->total_ticks += ticks;
+    if (ticks < stats->min_ticks) {
+        stats->min_ticks = ticks;
+    }
+    if (ticks > stats->max_ticks) {
+        stats->max_ticks = ticks;
+    }
+}
+#define STATS_START()           uint32_t stats_start = get_reference_time()
+#define STATS_END(stats, len)   fast_spi_stats_add(stats, len, get_reference_time() - stats_start)
+#else
+#define STATS_START()
+#define STATS_END(stats, len)
+#endif
+
+// sio port word for one dual Byte, indexed by the Byte
+static uint32_t sio_dual_lut[256];
+
+static void set_pad_delay(port_t p, int pad_delay) {
+    int c_word = XS1_SETC_MODE_LONG;
+    c_word = XS1_SETC_LMODE_SET(c_word, XS1_SETC_LMODE_PIN_DELAY);
+    c_word = XS1_SETC_VALUE_SET(c_word, pad_delay);
+    // port_write_control_word(p, c_word);
+    asm volatile( "setc res[%0], %1" :: "r" (p), "r" (c_word));
+}
+
+static void start_single_ports(fast_spi_master_handle_t* handle) {
+    // mosi
+    port_start_buffered(handle->p_mosi, 32);
+    port_out(handle->p_mosi, 0);
+    port_sync(handle->p_mosi);
+    port_set_clock(handle->p_mosi, handle->clk_blk);
+    // miso
+    port_start_buffered(handle->p_miso, 32);
+    port_set_clock(handle->p_miso, handle->clk_blk);
+    handle->miso_pad_delay = 0;
+}
+
+static void start_sio_port(fast_spi_master_handle_t* handle) {
+    // SIO2/SIO3 double as WP#/HOLD#, keep them high when not carrying data
+    port_start_buffered(handle->p_sio, 32);
+    port_out(handle->p_sio, 0xFFFFFFFF);
+    port_sync(handle->p_sio);
+    port_set_clock(handle->p_sio, handle->clk_blk);
+}
+
+/*
+ * Spread 4 SCK cycles of bits_per_clk bits (MSB first) over one sio port word,
+ * every SCK cycle takes 2 nibbles, SIO2/SIO3 stay high unless they carry bits
+ */
+static uint32_t sio_expand(unsigned bits, unsigned bits_per_clk) {
+    uint32_t word = 0;
+    unsigned mask = (1 << bits_per_clk) - 1;
+    for (int i = 0; i < 4; ++i) {
+        unsigned nibble = (bits >> ((3 - i) * bits_per_clk)) & mask;
+        if (bits_per_clk < 4) {
+            nibble |= 0xC;
+        }
+        word |= (nibble | (nibble << 4)) << (i * 8);
+    }
+    return word;
+}
+
+void fast_spi_stats_reset(fast_spi_stats_t* stats) {
+    stats->xfers = 0;
+    stats->rejects = 0;
+    stats->min_ticks = UINT32_MAX;
+    stats->max_ticks = 0;
+    stats->bytes = 0;
+    stats->total_ticks = 0;
+}
+
 void fast_spi_master_init(fast_spi_master_handle_t* handle, port_t p_sck, port_t p_miso, port_t p_mosi, port_t p_cs, xclock_t clk_blk, bool cs_assert_low) {
     handle->p_sck = p_sck;
     handle->p_miso = p_miso;
@@ -20,20 +103,20 @@ void fast_spi_master_init(fast_spi_master_handle_t* handle, port_t p_sck, port_t
     clock_set_source_clk_ref(clk_blk);
     handle->clk_divider = 0;
     handle->clk_src = fast_spi_clock_source_ref_clk;
+    handle->shared_clk_blk = clk_blk;
+    handle->sck_invert = false;
+    handle->switch_ticks = 0;
+    handle->max_switch_ticks = 0;
 
     // sck
     port_start_buffered(p_sck, 32);
     port_out(p_sck, 0x0);
     port_sync(p_sck);
     port_set_clock(p_sck, clk_blk);
-    // mosi
-    port_start_buffered(p_mosi, 32);
-    port_out(p_mosi, 0);
-    port_sync(p_mosi);
-    port_set_clock(p_mosi, clk_blk);
-    // miso
-    port_start_buffered(p_miso, 32);
-    port_set_clock(p_miso, clk_blk);
+    // mosi, miso
+    start_single_ports(handle);
+    handle->p_sio = 0;
+    handle->data_mode = fast_spi_data_mode_single;
     // cs
     handle->cs_deassert_pattern = cs_assert_low ? 0xFFFFFFFF : 0x0;
     port_enable(p_cs);
@@ -48,23 +131,52 @@ void fast_spi_master_device_init(
     uint32_t cs_pin,
     uint8_t cpol, uint8_t cpha,
     fast_spi_clock_source_t source_clk,
-    uint32_t clk_divider
+    uint32_t clk_divider,
+    fast_spi_data_mode_t data_mode
 ) {
     handle->master = master;
+    handle->data_mode = data_mode;
+    fast_spi_master_device_set_frame(handle, fast_spi_frame_msb8);
     handle->cs_bit_mask = master->cs_deassert_pattern ? ~(1 << cs_pin) : 1 << cs_pin;
     handle->clk_src = source_clk;
+    handle->clk_blk = master->shared_clk_blk;
+    handle->own_clk_blk = false;
+    for (int i = 0; i < FAST_SPI_CAL_CACHE_LEN; ++i) {
+        handle->cal[i].valid = false;
+    }
+    handle->cal_next = 0;
     fast_spi_master_set_clk_div(handle, clk_divider);
-    if (cpol == 0) {
-        handle->clk_pattern = cpha == 0 ? 0xAAAAAAAA : 0x55555555;
-        handle->idle_clk_pattern = 0x0;
+    // CPOL=1 is the CPOL=0 pattern on an inverted port, a polarity switch is a single setc
+    handle->sck_invert = cpol != 0;
+    handle->clk_pattern = cpha == 0 ? 0xAAAAAAAA : 0x55555555;
+    handle->idle_clk_pattern = 0x0;
+    fast_spi_stats_reset(&handle->stats);
+}
+
+void fast_spi_master_device_set_clk_blk(fast_spi_master_device_handle_t* handle, xclock_t clk_blk) {
+    handle->clk_blk = clk_blk;
+    handle->own_clk_blk = true;
+    clock_enable(clk_blk);
+    if (handle->clk_src == fast_spi_clock_source_ref_clk) {
+        clock_set_source_clk_ref(clk_blk);
     } else {
-        handle->clk_pattern = cpha == 0 ? 0x55555555 : 0xAAAAAAAA;
-        handle->idle_clk_pattern = 0xFFFFFFFF;
+        clock_set_source_clk_xcore(clk_blk);
+    }
+    clock_set_divide(clk_blk, handle->clk_divider);
+}
+
+void fast_spi_master_init_sio(fast_spi_master_handle_t* handle, port_t p_sio) {
+    handle->p_sio = p_sio;
+    for (int i = 0; i < 256; ++i) {
+        sio_dual_lut[i] = sio_expand(i, 2);
     }
 }
 
 void fast_spi_master_set_clk_div(fast_spi_master_device_handle_t* handle, uint32_t clk_divider) {
     handle->clk_divider = clk_divider;
+    if (handle->own_clk_blk) {
+        clock_set_divide(handle->clk_blk, clk_divider);
+    }
     // calulate input sample delay base on core clock and ref clock, more information on IO timings for xcore.ai
     unsigned ctrl0;
     unsigned pll_bypass;
@@ -114,36 +226,88 @@ void fast_spi_master_set_clk_div(fast_spi_master_device_handle_t* handle, uint32
     }
     handle->input_delay = 32 + setup_tick / sck_period;
     handle->input_delay_1B = 16 + setup_tick / sck_period;
+    handle->miso_pad_delay = 0;
+    handle->tick_core_clks = sck_period / core_div ? sck_period / core_div : 1;
+    // a calibrated sample point beats the estimate
+    for (int i = 0; i < FAST_SPI_CAL_CACHE_LEN; ++i) {
+        if (handle->cal[i].valid && handle->cal[i].clk_divider == clk_divider) {
+            handle->input_delay = 32 + handle->cal[i].extra;
+            handle->input_delay_1B = 16 + handle->cal[i].extra;
+            handle->miso_pad_delay = handle->cal[i].pad_delay;
+            break;
+        }
+    }
 }
 
 void fast_spi_master_init_xfer(fast_spi_master_device_handle_t* handle) {
-    if (handle->clk_src != handle->master->clk_src) {
-        handle->master->clk_src = handle->clk_src;
-        if (handle->clk_src == fast_spi_clock_source_ref_clk) {
-            clock_set_source_clk_ref(handle->master->clk_blk);
+    fast_spi_master_handle_t* master = handle->master;
+    uint32_t start = get_reference_time();
+    if (handle->clk_blk != master->clk_blk) {
+        // device has its own clock block (or leaves one), move the ports over
+        master->clk_blk = handle->clk_blk;
+        port_set_clock(master->p_sck, master->clk_blk);
+        port_set_clock(master->p_cs, master->clk_blk);
+        if (master->data_mode == fast_spi_data_mode_single) {
+            port_set_clock(master->p_mosi, master->clk_blk);
+            port_set_clock(master->p_miso, master->clk_blk);
+        } else {
+            port_set_clock(master->p_sio, master->clk_blk);
+        }
+    }
+    if (!handle->own_clk_blk) {
+        if (handle->clk_src != master->clk_src) {
+            master->clk_src = handle->clk_src;
+            if (handle->clk_src == fast_spi_clock_source_ref_clk) {
+                clock_set_source_clk_ref(master->clk_blk);
+            } else {
+                clock_set_source_clk_xcore(master->clk_blk);
+            }
+        }
+        if (handle->clk_divider != master->clk_divider) {
+            master->clk_divider = handle->clk_divider;
+            clock_set_divide(master->clk_blk, handle->clk_divider);
+        }
+    }
+    if (handle->sck_invert != master->sck_invert) {
+        // the pin goes to the new idle level right away
+        master->sck_invert = handle->sck_invert;
+        if (handle->sck_invert) {
+            port_set_invert(master->p_sck);
         } else {
-            clock_set_source_clk_xcore(handle->master->clk_blk);
+            port_set_no_invert(master->p_sck);
         }
     }
-    if (handle->clk_divider != handle->master->clk_divider) {
-        handle->master->clk_divider = handle->clk_divider;
-        clock_set_divide(handle->master->clk_blk, handle->clk_divider);
+    if (handle->data_mode != master->data_mode) {
+        // p_sio overlaps mosi/miso, only one set of ports can own the pins
+        if (master->data_mode == fast_spi_data_mode_single) {
+            port_disable(master->p_mosi);
+            port_disable(master->p_miso);
+            start_sio_port(master);
+        } else if (handle->data_mode == fast_spi_data_mode_single) {
+            port_disable(master->p_sio);
+            start_single_ports(master);
+        }
+        master->data_mode = handle->data_mode;
     }
-    if (handle->idle_clk_pattern != handle->master->idle_clk_pattern) {
-        handle->master->idle_clk_pattern = handle->idle_clk_pattern;
-        port_set_clock(handle->master->p_sck, XS1_CLKBLK_REF);
-        port_out(handle->master->p_sck, handle->idle_clk_pattern);
-        port_set_clock(handle->master->p_sck, handle->master->clk_blk);
-        port_clear_buffer(handle->master->p_sck);
+    if (handle->data_mode == fast_spi_data_mode_single && handle->miso_pad_delay != master->miso_pad_delay) {
+        master->miso_pad_delay = handle->miso_pad_delay;
+        set_pad_delay(master->p_miso, master->miso_pad_delay);
+    }
+    // clock block is stopped between xfers, one clear drops everything left behind
+    port_clear_buffer(master->p_sck);
+    if (handle->data_mode != fast_spi_data_mode_single) {
+        port_clear_buffer(master->p_sio);
+    } else {
+        port_clear_buffer(master->p_mosi);
+        port_clear_buffer(master->p_miso);
+    }
+    master->switch_ticks = get_reference_time() - start;
+    if (master->switch_ticks > master->max_switch_ticks) {
+        master->max_switch_ticks = master->switch_ticks;
     }
-    port_clear_buffer(handle->master->p_sck);
-    port_clear_buffer(handle->master->p_mosi);
-    port_endin(handle->master->p_miso);
-    port_clear_buffer(handle->master->p_miso);
-    port_clear_buffer(handle->master->p_miso);
 }
 
-extern unsigned spi_master_short_xfer(
+extern unsigned spi_master_burst_xfer(
     port_t p_sck,
     port_t p_miso,
     port_t p_mosi,
@@ -159,26 +323,112 @@ extern unsigned spi_master_short_xfer(
     uint32_t idle_clk_pattern
 );
 
-extern unsigned spi_master_burst_xfer(
+extern unsigned spi_master_tx_xfer(
     port_t p_sck,
     port_t p_miso,
     port_t p_mosi,
     port_t p_cs,
     xclock_t clk_blk,
     uint8_t* tx_buf,
+    size_t xfer_len,
+    uint32_t clk_pattern,
+    uint32_t finish_cs_pattern,
+    uint32_t idle_clk_pattern
+);
+
+extern unsigned spi_master_rx_xfer(
+    port_t p_sck,
+    port_t p_miso,
+    port_t p_mosi,
+    port_t p_cs,
+    xclock_t clk_blk,
     uint8_t* rx_buf,
     size_t xfer_len,
-    size_t input_delay_1B,
     size_t input_delay,
     uint32_t clk_pattern,
     uint32_t finish_cs_pattern,
     uint32_t idle_clk_pattern
 );
 
-void fast_spi_master_xfer(fast_spi_master_device_handle_t* handle, uint8_t* tx_buf, uint8_t* rx_buf, size_t xfer_len) {
+// every kernel is assembled once per fast_spi_frame_t, the msb8 one without a suffix
+typedef __typeof__(spi_master_burst_xfer) burst_kernel_t;
+typedef __typeof__(spi_master_tx_xfer) tx_kernel_t;
+typedef __typeof__(spi_master_rx_xfer) rx_kernel_t;
+typedef __typeof__(*(fast_spi_fixed_kernel_t)0) fixed_kernel_t;
+
+#define DECLARE_FRAMED(type, name) extern type name##_msb16, name##_msb32, name##_lsb
+#define FRAMED(name) {name, name##_msb16, name##_msb32, name##_lsb}
+
+DECLARE_FRAMED(burst_kernel_t, spi_master_burst_xfer);
+DECLARE_FRAMED(tx_kernel_t, spi_master_tx_xfer);
+DECLARE_FRAMED(rx_kernel_t, spi_master_rx_xfer);
+
+#define DECLARE_FIXED(name) \
+    extern fixed_kernel_t name##_1, name##_2, name##_3, name##_4, name##_5, name##_6, name##_7, name##_8
+#define FIXED(name) {name##_1, name##_2, name##_3, name##_4, name##_5, name##_6, name##_7, name##_8}
+DECLARE_FIXED(spi_master_fixed_xfer);
+DECLARE_FIXED(spi_master_fixed_xfer_msb16);
+DECLARE_FIXED(spi_master_fixed_xfer_msb32);
+DECLARE_FIXED(spi_master_fixed_xfer_lsb);
+
+static burst_kernel_t* const burst_kernels[] = FRAMED(spi_master_burst_xfer);
+static tx_kernel_t* const tx_kernels[] = FRAMED(spi_master_tx_xfer);
+static rx_kernel_t* const rx_kernels[] = FRAMED(spi_master_rx_xfer);
+
+static const fast_spi_fixed_kernel_t fixed_kernels[][FAST_SPI_FIXED_MAX_LEN] = {
+    FIXED(spi_master_fixed_xfer), FIXED(spi_master_fixed_xfer_msb16),
+    FIXED(spi_master_fixed_xfer_msb32), FIXED(spi_master_fixed_xfer_lsb)
+};
+
+void fast_spi_master_device_set_frame(fast_spi_master_device_handle_t* handle, fast_spi_frame_t frame) {
+    handle->frame = frame;
+    handle->fixed_kernels = fixed_kernels[frame];
+}
+
+bool fast_spi_master_xfer(fast_spi_master_device_handle_t* handle, uint8_t* tx_buf, uint8_t* rx_buf, size_t xfer_len) {
+    // p_mosi and p_miso are off while a dual/quad device has the pins
+    if ((tx_buf == NULL && rx_buf == NULL) || xfer_len == 0 || handle->data_mode != fast_spi_data_mode_single) {
+        return false;
+    }
+    STATS_START();
     port_out(handle->master->p_cs, handle->cs_bit_mask);
-    if (xfer_len < 5) {
-        spi_master_short_xfer(
+    if (rx_buf == NULL) {
+        tx_kernels[handle->frame](
+            handle->master->p_sck,
+            handle->master->p_miso,
+            handle->master->p_mosi,
+            handle->master->p_cs,
+            handle->master->clk_blk,
+            tx_buf, xfer_len,
+            handle->clk_pattern, handle->master->cs_deassert_pattern,
+            handle->idle_clk_pattern
+        );
+    } else if (tx_buf == NULL) {
+        rx_kernels[handle->frame](
+            handle->master->p_sck,
+            handle->master->p_miso,
+            handle->master->p_mosi,
+            handle->master->p_cs,
+            handle->master->clk_blk,
+            rx_buf, xfer_len,
+            handle->input_delay,
+            handle->clk_pattern, handle->master->cs_deassert_pattern,
+            handle->idle_clk_pattern
+        );
+    } else if (xfer_len <= FAST_SPI_FIXED_MAX_LEN) {
+        handle->fixed_kernels[xfer_len - 1](
+            handle->master->p_sck,
+            handle->master->p_miso,
+            handle->master->p_mosi,
+            handle->master->p_cs,
+            handle->master->clk_blk,
+            tx_buf, rx_buf,
+            xfer_len == 1 ? handle->input_delay_1B : handle->input_delay,
+            handle->clk_pattern, handle->master->cs_deassert_pattern,
+            handle->idle_clk_pattern
+        );
+    } else {
+        burst_kernels[handle->frame](
             handle->master->p_sck,
             handle->master->p_miso,
             handle->master->p_mosi,
@@ -189,8 +439,158 @@ void fast_spi_master_xfer(fast_spi_master_device_handle_t* handle, uint8_t* tx_b
             handle->clk_pattern, handle->master->cs_deassert_pattern,
             handle->idle_clk_pattern
         );
+    }
+    STATS_END(&handle->stats, xfer_len);
+    return true;
+}
+
+extern unsigned spi_master_burst_crc_xfer(
+    port_t p_sck,
+    port_t p_miso,
+    port_t p_mosi,
+    port_t p_cs,
+    xclock_t clk_blk,
+    uint8_t* tx_buf,
+    uint8_t* rx_buf,
+    size_t xfer_len,
+    size_t input_delay_1B,
+    size_t input_delay,
+    uint32_t clk_pattern,
+    uint32_t finish_cs_pattern,
+    uint32_t idle_clk_pattern,
+    uint32_t* crc   // poly, tx, rx
+);
+
+typedef __typeof__(spi_master_burst_crc_xfer) burst_crc_kernel_t;
+DECLARE_FRAMED(burst_crc_kernel_t, spi_master_burst_crc_xfer);
+static burst_crc_kernel_t* const burst_crc_kernels[] = FRAMED(spi_master_burst_crc_xfer);
+
+static inline uint32_t bitrev(uint32_t x) {
+    asm("bitrev %0, %1" : "=r" (x) : "r" (x));
+    return x;
+}
+
+static inline uint32_t byterev(uint32_t x) {
+    asm("byterev %0, %1" : "=r" (x) : "r" (x));
+    return x;
+}
+
+static inline uint32_t crc32_word(uint32_t reg, uint32_t data, uint32_t poly) {
+    asm("crc32 %0, %2, %3" : "=r" (reg) : "0" (reg), "r" (data), "r" (poly));
+    return reg;
+}
+
+// the kernels run every CRC bit reflected, the first bit on the wire goes in first
+static uint32_t crc_reflect(uint32_t x, unsigned width) {
+    return bitrev(x) >> (32 - width);
+}
+
+static uint32_t crc_final(const fast_spi_crc_t* crc, uint32_t reg) {
+    if (!crc->reflect) {
+        reg = crc_reflect(reg, crc->width);
+    }
+    reg ^= crc->xorout;
+    return crc->width == 32 ? reg : reg & ((1u << crc->width) - 1);
+}
+
+// buffer index of the Byte at wire position pos
+static size_t wire_index(size_t pos, fast_spi_frame_t frame) {
+    if (frame == fast_spi_frame_msb16) {
+        return pos ^ 1;
+    }
+    if (frame == fast_spi_frame_msb32) {
+        return pos ^ 3;
+    }
+    return pos;
+}
+
+// Byte at wire position pos with its first bit on the wire in bit 0
+static uint32_t wire_byte(const uint8_t* buf, size_t pos, fast_spi_frame_t frame) {
+    uint32_t b = buf[wire_index(pos, frame)];
+    return frame == fast_spi_frame_lsb ? b : bitrev(b) >> 24;
+}
+
+// same as the FRAME_* steps of the kernels, see spi_frame.h
+static uint32_t port_word(uint32_t w, fast_spi_frame_t frame) {
+    switch (frame) {
+    case fast_spi_frame_msb8:
+        return byterev(bitrev(w));
+    case fast_spi_frame_msb16:
+        w = bitrev(w);
+        return (w << 16) | (w >> 16);
+    case fast_spi_frame_msb32:
+        return bitrev(w);
+    default:
+        return w;
+    }
+}
+
+// run reg over buf[from, to) in wire order, whole words through crc32, buf word aligned
+static uint32_t crc_wire(uint32_t reg, uint32_t poly, const uint8_t* buf, size_t from, size_t to, fast_spi_frame_t frame) {
+    while (from < to) {
+        if ((from & 3) == 0 && to - from >= 4) {
+            reg = crc32_word(reg, port_word(*(const uint32_t*)&buf[from], frame), poly);
+            from += 4;
+            continue;
+        }
+        reg ^= wire_byte(buf, from, frame);
+        for (int i = 0; i < 8; ++i) {
+            reg = (reg & 1) ? (reg >> 1) ^ poly : reg >> 1;
+        }
+        ++from;
+    }
+    return reg;
+}
+
+// CRC as it goes on the wire from position pos, MSB first unless reflect
+static uint32_t crc_get(const fast_spi_crc_t* crc, const uint8_t* buf, size_t pos, fast_spi_frame_t frame) {
+    uint32_t v = 0;
+    for (unsigned i = 0; i < crc->width / 8u; ++i) {
+        uint32_t b = wire_byte(buf, pos + i, frame);
+        v = crc->reflect ? v | (b << (8 * i)) : (v << 8) | (bitrev(b) >> 24);
+    }
+    return v;
+}
+
+static void crc_put(const fast_spi_crc_t* crc, uint32_t v, uint8_t* buf, size_t pos, fast_spi_frame_t frame) {
+    unsigned n = crc->width / 8u;
+    for (unsigned i = 0; i < n; ++i) {
+        uint32_t b = crc->reflect ? (v >> (8 * i)) & 0xFF : bitrev((v >> (8 * (n - 1 - i))) & 0xFF) >> 24;
+        buf[wire_index(pos + i, frame)] = frame == fast_spi_frame_lsb ? b : bitrev(b) >> 24;
+    }
+}
+
+bool fast_spi_master_xfer_crc(
+    fast_spi_master_device_handle_t* handle, const fast_spi_crc_t* crc,
+    uint8_t* tx_buf, uint8_t* rx_buf, size_t xfer_len,
+    unsigned flags, uint32_t* tx_crc, uint32_t* rx_crc
+) {
+    fast_spi_frame_t frame = handle->frame;
+    size_t n = crc->width / 8u;
+    if (handle->data_mode != fast_spi_data_mode_single || (flags != 0 && xfer_len <= n)) {
+        return false;
+    }
+    size_t tx_end = (flags & FAST_SPI_CRC_APPEND) ? xfer_len - n : xfer_len;
+    size_t rx_end = (flags & FAST_SPI_CRC_CHECK) ? xfer_len - n : xfer_len;
+    uint32_t poly = crc_reflect(crc->poly, crc->width);
+    uint32_t init = crc_reflect(crc->init, crc->width);
+    uint32_t regs[3] = {poly, init, init};
+    uint32_t tx_val = 0;
+    size_t tx_from = 0;
+    size_t rx_from = 0;
+
+    if (flags & FAST_SPI_CRC_APPEND) {
+        tx_val = crc_final(crc, crc_wire(init, poly, tx_buf, 0, tx_end, frame));
+        crc_put(crc, tx_val, tx_buf, tx_end, frame);
+    }
+    if (xfer_len <= FAST_SPI_FIXED_MAX_LEN) {
+        fast_spi_master_xfer(handle, tx_buf, rx_buf, xfer_len);
     } else {
-        spi_master_burst_xfer(
+        // the kernel CRCs tx from its second word on
+        regs[1] = crc_wire(init, poly, tx_buf, 0, 4, frame);
+        STATS_START();
+        port_out(handle->master->p_cs, handle->cs_bit_mask);
+        burst_crc_kernels[frame](
             handle->master->p_sck,
             handle->master->p_miso,
             handle->master->p_mosi,
@@ -199,29 +599,588 @@ void fast_spi_master_xfer(fast_spi_master_device_handle_t* handle, uint8_t* tx_b
             tx_buf, rx_buf, xfer_len,
             handle->input_delay_1B, handle->input_delay,
             handle->clk_pattern, handle->master->cs_deassert_pattern,
-            handle->idle_clk_pattern
+            handle->idle_clk_pattern,
+            regs
         );
+        STATS_END(&handle->stats, xfer_len);
+        size_t rounds = xfer_len >= 10 ? (xfer_len - 10) / 4 + 1 : 0;
+        tx_from = 4 * rounds + 4;
+        rx_from = 4 * rounds;
+    }
+
+    if (!(flags & FAST_SPI_CRC_APPEND)) {
+        tx_val = crc_final(crc, crc_wire(regs[1], poly, tx_buf, tx_from, tx_end, frame));
+    }
+    uint32_t rx_val = crc_final(crc, crc_wire(regs[2], poly, rx_buf, rx_from, rx_end, frame));
+    if (tx_crc != NULL) {
+        *tx_crc = tx_val;
+    }
+    if (rx_crc != NULL) {
+        *rx_crc = rx_val;
+    }
+    return !(flags & FAST_SPI_CRC_CHECK) || rx_val == crc_get(crc, rx_buf, rx_end, frame);
+}
+
+
+typedef struct {
+    uint32_t time;      // core clock cycles after the earliest sample point
+    uint8_t extra;
+    uint8_t pad_delay;
+    bool good;
+} cal_point_t;
+
+static bool cal_try(
+    fast_spi_master_device_handle_t* handle, size_t extra, size_t pad_delay,
+    uint8_t* tx_buf, uint8_t* rx_buf, size_t xfer_len,
+    const uint8_t* expected, size_t check_from
+) {
+    handle->input_delay = 32 + extra;
+    handle->input_delay_1B = 16 + extra;
+    handle->miso_pad_delay = pad_delay;
+    fast_spi_master_init_xfer(handle);
+    for (int i = 0; i < FAST_SPI_CAL_REPEAT; ++i) {
+        memset(rx_buf, ~expected[0], xfer_len);
+        fast_spi_master_xfer(handle, tx_buf, rx_buf, xfer_len);
+        if (memcmp(&rx_buf[check_from], expected, xfer_len - check_from) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool fast_spi_master_calibrate(
+    fast_spi_master_device_handle_t* handle,
+    uint8_t* tx_buf, uint8_t* rx_buf, size_t xfer_len,
+    const uint8_t* expected, size_t check_from
+) {
+    cal_point_t points[(FAST_SPI_CAL_MAX_EXTRA + 1) * (FAST_SPI_CAL_MAX_PAD_DELAY + 1)];
+    size_t num = 0;
+    if (handle->data_mode != fast_spi_data_mode_single || check_from >= xfer_len) {
+        return false;
+    }
+    for (size_t extra = 0; extra <= FAST_SPI_CAL_MAX_EXTRA; ++extra) {
+        for (size_t pad_delay = 0; pad_delay <= FAST_SPI_CAL_MAX_PAD_DELAY; ++pad_delay) {
+            cal_point_t point = {
+                extra * handle->tick_core_clks + pad_delay, extra, pad_delay,
+                cal_try(handle, extra, pad_delay, tx_buf, rx_buf, xfer_len, expected, check_from)
+            };
+            // keep points in sample time order, a pad delay can reach past the next tick
+            size_t i = num++;
+            while (i > 0 && points[i - 1].time > point.time) {
+                points[i] = points[i - 1];
+                --i;
+            }
+            points[i] = point;
+        }
     }
+
+    // longest run of good points is the eye
+    size_t best_start = 0, best_len = 0;
+    for (size_t i = 0; i < num; ) {
+        size_t j = i;
+        while (j < num && points[j].good) {
+            ++j;
+        }
+        if (j - i > best_len) {
+            best_start = i;
+            best_len = j - i;
+        }
+        i = j + 1;
+    }
+    if (best_len == 0) {
+        fast_spi_master_set_clk_div(handle, handle->clk_divider);
+        fast_spi_master_init_xfer(handle);
+        return false;
+    }
+
+    // point closest to the middle of the eye in time
+    uint32_t centre = (points[best_start].time + points[best_start + best_len - 1].time) / 2;
+    cal_point_t* pick = &points[best_start];
+    for (size_t i = best_start; i < best_start + best_len; ++i) {
+        uint32_t d = points[i].time > centre ? points[i].time - centre : centre - points[i].time;
+        uint32_t d_pick = pick->time > centre ? pick->time - centre : centre - pick->time;
+        if (d < d_pick) {
+            pick = &points[i];
+        }
+    }
+
+    fast_spi_cal_t* cal = NULL;
+    for (int i = 0; i < FAST_SPI_CAL_CACHE_LEN; ++i) {
+        if (handle->cal[i].valid && handle->cal[i].clk_divider == handle->clk_divider) {
+            cal = &handle->cal[i];
+        }
+    }
+    if (cal == NULL) {
+        cal = &handle->cal[handle->cal_next];
+        handle->cal_next = (handle->cal_next + 1) % FAST_SPI_CAL_CACHE_LEN;
+    }
+    cal->valid = true;
+    cal->clk_divider = handle->clk_divider;
+    cal->extra = pick->extra;
+    cal->pad_delay = pick->pad_delay;
+    fast_spi_master_set_clk_div(handle, handle->clk_divider);
+    fast_spi_master_init_xfer(handle);
+    return true;
 }
 
+/*
+ * The async xfer runs one port word (2 Bytes, 16 SCK cycles) per p_miso interrupt on the calling core. Every
+ * word is timed: sck and mosi at its first tick, miso at the input delay after it, so an interrupt that comes
+ * late only stretches SCK between words. Word k+1 starts step ticks after word k, the input delay plus the
+ * interrupt lead, a word in is all it takes to queue the next one.
+ */
+
+#define ASYNC_CS_LEAD   2   // port clock ticks CS asserts ahead of the first SCK tick
+
+// bit i to bits 2i and 2i+1, every bit on the wire takes 2 port clock ticks
+static uint32_t async_spread(uint32_t x) {
+    x = (x | x << 8) & 0x00FF00FF;
+    x = (x | x << 4) & 0x0F0F0F0F;
+    x = (x | x << 2) & 0x33333333;
+    x = (x | x << 1) & 0x55555555;
+    return x | x << 1;
+}
+
+// odd bits, the sample the kernels keep after unzip
+static uint32_t async_compress(uint32_t x) {
+    x = (x >> 1) & 0x55555555;
+    x = (x | x >> 1) & 0x33333333;
+    x = (x | x >> 2) & 0x0F0F0F0F;
+    x = (x | x >> 4) & 0x00FF00FF;
+    return (x | x >> 8) & 0xFFFF;
+}
+
+static void async_out(fast_spi_master_async_t* ctx) {
+    fast_spi_master_device_handle_t* handle = ctx->handle;
+    size_t k = ctx->word;
+    if ((k & 1) == 0 && ctx->tx_buf != NULL) {
+        ctx->tx_word = port_word(ctx->tx_buf[k / 2], handle->frame);
+    }
+    uint32_t clk = handle->clk_pattern;
+    if (2 * k + 1 == ctx->len) {
+        // 1 Byte tail, SCK idles for the second half
+        clk = (clk & 0xFFFF) | (handle->idle_clk_pattern & 0xFFFF0000);
+    }
+    uint16_t t = ctx->time;
+    port_clear_buffer(handle->master->p_miso);
+    port_set_trigger_time(handle->master->p_miso, t - 1 + handle->input_delay);
+    port_set_trigger_time(handle->master->p_sck, t);
+    port_out(handle->master->p_sck, clk);
+    port_set_trigger_time(handle->master->p_mosi, t);
+    port_out(handle->master->p_mosi, async_spread(k & 1 ? ctx->tx_word >> 16 : ctx->tx_word & 0xFFFF));
+}
+
+static void async_in(fast_spi_master_async_t* ctx, uint32_t half) {
+    size_t k = ctx->word;
+    if (k & 1) {
+        ctx->rx_word |= half << 16;
+    } else {
+        ctx->rx_word = half;
+    }
+    if (ctx->rx_buf == NULL || ((k & 1) == 0 && 2 * k + 2 < ctx->len)) {
+        return;
+    }
+    // a whole buffer word, or the last Bytes of the xfer
+    uint32_t w = port_word(ctx->rx_word, ctx->handle->frame);
+    size_t pos = 4 * (k / 2);
+    if (ctx->len - pos >= 4) {
+        ctx->rx_buf[k / 2] = w;
+    } else {
+        memcpy((uint8_t*)ctx->rx_buf + pos, &w, ctx->len - pos);
+    }
+}
+
+DEFINE_INTERRUPT_CALLBACK(fast_spi_master_irq, fast_spi_master_async_isr, arg) {
+    fast_spi_master_async_t* ctx = arg;
+    fast_spi_master_handle_t* master = ctx->handle->master;
+    async_in(ctx, async_compress(port_in(master->p_miso)));
+    if (++ctx->word < ctx->num_words) {
+        ctx->time += ctx->step;
+        async_out(ctx);
+        return;
+    }
+    triggerable_disable_trigger(master->p_miso);
+    port_out(master->p_sck, ctx->handle->idle_clk_pattern);
+    port_sync(master->p_sck);
+    port_out(master->p_cs, master->cs_deassert_pattern);
+    port_sync(master->p_cs);
+    clock_stop(master->clk_blk);
+    port_clear_buffer(master->p_miso);
+#if FAST_SPI_STATS
+    fast_spi_stats_add(&ctx->handle->stats, ctx->len, get_reference_time() - ctx->stats_start);
+#endif
+    s_chan_out_word(ctx->c_done.end_a, 0);
+}
+
+void fast_spi_master_async_init(fast_spi_master_async_t* ctx) {
+    ctx->c_done = s_chan_alloc();
+    ctx->busy = false;
+}
+
+void fast_spi_master_xfer_start(fast_spi_master_async_t* ctx, fast_spi_master_device_handle_t* handle, uint8_t* tx_buf, uint8_t* rx_buf, size_t xfer_len) {
+    fast_spi_master_xfer_wait(ctx);
+    if ((tx_buf == NULL && rx_buf == NULL) || xfer_len == 0) {
+        return;
+    }
+#if FAST_SPI_STATS
+    ctx->stats_start = get_reference_time();
+#endif
+    fast_spi_master_handle_t* master = handle->master;
+    ctx->handle = handle;
+    ctx->tx_buf = (const uint32_t*)tx_buf;
+    ctx->rx_buf = (uint32_t*)rx_buf;
+    ctx->len = xfer_len;
+    ctx->num_words = (xfer_len + 1) / 2;
+    ctx->word = 0;
+    ctx->tx_word = 0;
+    ctx->step = handle->input_delay + (FAST_SPI_ASYNC_LEAD_CLKS + handle->tick_core_clks - 1) / handle->tick_core_clks;
+    // port time counts from 0 once the clock block starts
+    ctx->time = ASYNC_CS_LEAD + 1;
+    ctx->busy = true;
+
+    interrupt_mask_all();
+    port_set_trigger_time(master->p_cs, 1);
+    port_out(master->p_cs, handle->cs_bit_mask);
+    async_out(ctx);
+    triggerable_setup_interrupt_callback(master->p_miso, ctx, INTERRUPT_CALLBACK(fast_spi_master_async_isr));
+    triggerable_enable_trigger(master->p_miso);
+    clock_start(master->clk_blk);
+    interrupt_unmask_all();
+}
+
+void fast_spi_master_xfer_wait(fast_spi_master_async_t* ctx) {
+    if (ctx->busy) {
+        s_chan_in_word(ctx->c_done.end_b);
+        ctx->busy = false;
+    }
+}
+
+void fast_spi_master_async_stop(fast_spi_master_async_t* ctx) {
+    fast_spi_master_xfer_wait(ctx);
+    s_chan_free(ctx->c_done);
+}
+
+extern unsigned spi_master_list_xfer(
+    port_t p_sck,
+    port_t p_miso,
+    port_t p_mosi,
+    port_t p_cs,
+    xclock_t clk_blk,
+    fast_spi_master_device_handle_t** devices,
+    fast_spi_xfer_t* xfers,
+    size_t num_xfers,
+    size_t input_delay,
+    uint32_t finish_cs_pattern,
+    uint32_t idle_clk_pattern,
+    size_t gap
+);
+
+// spi_master_list_xfer reads these fields directly
+_Static_assert(offsetof(fast_spi_xfer_t, dev_id) == 0 && offsetof(fast_spi_xfer_t, tx_buf) == 4 &&
+               offsetof(fast_spi_xfer_t, rx_buf) == 8 && offsetof(fast_spi_xfer_t, len) == 12 &&
+               sizeof(fast_spi_xfer_t) == 16, "fast_spi_xfer_t layout doesn't match spi_master_list_xfer.S");
+_Static_assert(offsetof(fast_spi_master_device_handle_t, cs_bit_mask) == 4 &&
+               offsetof(fast_spi_master_device_handle_t, clk_pattern) == 16,
+               "fast_spi_master_device_handle_t layout doesn't match spi_master_list_xfer.S");
+
+// a run goes out with the ports and sample point of its first device
+static inline bool same_bus_config(fast_spi_master_device_handle_t* a, fast_spi_master_device_handle_t* b) {
+    return a->master == b->master &&
+           a->clk_blk == b->clk_blk &&
+           a->clk_src == b->clk_src &&
+           a->clk_divider == b->clk_divider &&
+           a->sck_invert == b->sck_invert &&
+           a->idle_clk_pattern == b->idle_clk_pattern &&
+           a->input_delay == b->input_delay &&
+           a->miso_pad_delay == b->miso_pad_delay &&
+           a->data_mode == b->data_mode;
+}
+
+#if FAST_SPI_STATS
+// a run is timed as a whole, every entry counts for its own device with its share of the port clock ticks
+static void list_stats(fast_spi_master_device_handle_t** devices, fast_spi_xfer_t* xfers, size_t num_xfers, uint32_t ticks) {
+    uint64_t run_ticks = 0;
+    for (size_t i = 0; i < num_xfers; ++i) {
+        run_ticks += 16 * xfers[i].len + FAST_SPI_LIST_GAP_TICKS;
+    }
+    for (size_t i = 0; i < num_xfers; ++i) {
+        uint64_t entry_ticks = 16 * xfers[i].len + FAST_SPI_LIST_GAP_TICKS;
+        fast_spi_stats_add(&devices[xfers[i].dev_id]->stats, xfers[i].len, ticks * entry_ticks / run_ticks);
+    }
+}
+#endif
+
+bool fast_spi_master_xfer_list(fast_spi_master_device_handle_t** devices, fast_spi_xfer_t* xfers, size_t num_xfers) {
+    // the list kernel only does msb8
+    for (size_t i = 0; i < num_xfers; ++i) {
+        fast_spi_master_device_handle_t* dev = devices[xfers[i].dev_id];
+        if (dev->data_mode != fast_spi_data_mode_single || dev->frame != fast_spi_frame_msb8) {
+            return false;
+        }
+    }
+    size_t start = 0;
+    while (start < num_xfers) {
+        // entries sharing clock setup run in one go, the clock block only stops for a device switch
+        fast_spi_master_device_handle_t* dev = devices[xfers[start].dev_id];
+        size_t end = start + 1;
+        while (end < num_xfers && same_bus_config(dev, devices[xfers[end].dev_id])) {
+            ++end;
+        }
+        fast_spi_master_init_xfer(dev);
+        STATS_START();
+        spi_master_list_xfer(
+            dev->master->p_sck,
+            dev->master->p_miso,
+            dev->master->p_mosi,
+            dev->master->p_cs,
+            dev->master->clk_blk,
+            devices, &xfers[start], end - start,
+            dev->input_delay, dev->master->cs_deassert_pattern,
+            dev->idle_clk_pattern,
+            FAST_SPI_LIST_GAP_TICKS
+        );
+#if FAST_SPI_STATS
+        list_stats(devices, &xfers[start], end - start, get_reference_time() - stats_start);
+#endif
+        start = end;
+    }
+    return true;
+}
+
+
+extern unsigned spi_master_sg_xfer(
+    port_t p_sck,
+    port_t p_miso,
+    port_t p_mosi,
+    port_t p_cs,
+    xclock_t clk_blk,
+    fast_spi_seg_t* segs,
+    size_t num_segs,
+    uint32_t cs_bit_mask,
+    size_t input_delay,
+    uint32_t clk_pattern,
+    uint32_t finish_cs_pattern,
+    uint32_t idle_clk_pattern,
+    size_t gap
+);
+
+// spi_master_sg_xfer reads these fields directly
+_Static_assert(offsetof(fast_spi_seg_t, tx_buf) == 0 && offsetof(fast_spi_seg_t, rx_buf) == 4 &&
+               offsetof(fast_spi_seg_t, len) == 8 && sizeof(fast_spi_seg_t) == 12,
+               "fast_spi_seg_t layout doesn't match spi_master_sg_xfer.S");
+
+bool fast_spi_master_xfer_sg(fast_spi_master_device_handle_t* handle, fast_spi_seg_t* segs, size_t num_segs) {
+    if (num_segs == 0 || handle->data_mode != fast_spi_data_mode_single || handle->frame != fast_spi_frame_msb8) {
+        return false;
+    }
+    // the kernel moves whole words from the start of every segment
+    for (size_t i = 0; i < num_segs; ++i) {
+        if (segs[i].len == 0 || ((uintptr_t)segs[i].tx_buf & 3) != 0 || ((uintptr_t)segs[i].rx_buf & 3) != 0) {
+            return false;
+        }
+    }
+    STATS_START();
+    spi_master_sg_xfer(
+        handle->master->p_sck,
+        handle->master->p_miso,
+        handle->master->p_mosi,
+        handle->master->p_cs,
+        handle->master->clk_blk,
+        segs, num_segs,
+        handle->cs_bit_mask, handle->input_delay,
+        handle->clk_pattern, handle->master->cs_deassert_pattern,
+        handle->idle_clk_pattern,
+        FAST_SPI_SG_GAP_TICKS
+    );
+#if FAST_SPI_STATS
+    size_t len = 0;
+    for (size_t i = 0; i < num_segs; ++i) {
+        len += segs[i].len;
+    }
+#endif
+    STATS_END(&handle->stats, len);
+    return true;
+}
+
+extern unsigned spi_master_sio_xfer(
+    port_t p_sck,
+    port_t p_sio,
+    port_t p_cs,
+    uint32_t* cmd_words,
+    size_t cmd_nslots,
+    size_t dummy_nslots,
+    uint8_t* tx_buf,
+    uint8_t* rx_buf,
+    size_t data_nslots,
+    fast_spi_data_mode_t data_mode,
+    const uint32_t* dual_lut,
+    size_t input_time,
+    uint32_t clk_pattern,
+    uint32_t finish_cs_pattern,
+    uint32_t idle_clk_pattern,
+    xclock_t clk_blk
+);
+
+// what spi_master_sio_xfer can't take: no sio port, a 1-bit device, no data slot or half a quad slot
+static bool sio_xfer_ok(
+    fast_spi_master_device_handle_t* handle,
+    size_t dummy_cycles,
+    uint8_t* tx_buf, uint8_t* rx_buf, size_t data_len
+) {
+    if (handle->master->p_sio == 0 || handle->data_mode == fast_spi_data_mode_single) {
+        return false;
+    }
+    if ((tx_buf == NULL && rx_buf == NULL) || dummy_cycles % 4 != 0) {
+        return false;
+    }
+    if (handle->data_mode == fast_spi_data_mode_quad) {
+        return data_len >= 2 && data_len % 2 == 0;
+    }
+    return data_len != 0;
+}
+
+static void sio_xfer(
+    fast_spi_master_device_handle_t* handle,
+    uint32_t* cmd_words, size_t cmd_nslots, size_t cmd_len,
+    size_t dummy_cycles,
+    uint8_t* tx_buf, uint8_t* rx_buf, size_t data_len
+) {
+    size_t dummy_nslots = rx_buf != NULL ? dummy_cycles / 4 : 0;
+    size_t data_nslots = handle->data_mode == fast_spi_data_mode_quad ? data_len / 2 : data_len;
+    STATS_START();
+    port_out(handle->master->p_cs, handle->cs_bit_mask);
+    spi_master_sio_xfer(
+        handle->master->p_sck,
+        handle->master->p_sio,
+        handle->master->p_cs,
+        cmd_words, cmd_nslots, dummy_nslots,
+        tx_buf, rx_buf, data_nslots,
+        handle->data_mode, sio_dual_lut,
+        (cmd_nslots + dummy_nslots + 1) * 8 + handle->input_delay - 32,
+        handle->clk_pattern, handle->master->cs_deassert_pattern,
+        handle->idle_clk_pattern,
+        handle->master->clk_blk
+    );
+    STATS_END(&handle->stats, cmd_len + data_len);
+}
+
+bool fast_spi_master_xfer_wide(
+    fast_spi_master_device_handle_t* handle,
+    uint8_t* cmd_buf, size_t cmd_len,
+    size_t dummy_cycles,
+    uint8_t* tx_buf, uint8_t* rx_buf, size_t data_len
+) {
+    if (cmd_len == 0 || cmd_len > FAST_SPI_MAX_CMD_LEN || !sio_xfer_ok(handle, dummy_cycles, tx_buf, rx_buf, data_len)) {
+        return false;
+    }
+    uint32_t cmd_words[2*FAST_SPI_MAX_CMD_LEN];
+    // command and address go out 1-bit on SIO0, half a Byte per slot
+    for (int i = 0; i < cmd_len; ++i) {
+        cmd_words[2*i] = sio_expand(cmd_buf[i] >> 4, 1);
+        cmd_words[2*i+1] = sio_expand(cmd_buf[i] & 0xF, 1);
+    }
+    sio_xfer(handle, cmd_words, 2 * cmd_len, cmd_len, dummy_cycles, tx_buf, rx_buf, data_len);
+    return true;
+}
+
+bool fast_spi_master_xfer_wide_io(
+    fast_spi_master_device_handle_t* handle,
+    const uint8_t* cmd_buf, size_t cmd_len,
+    const uint8_t* addr_buf, size_t addr_len,
+    size_t dummy_cycles,
+    uint8_t* tx_buf, uint8_t* rx_buf, size_t data_len
+) {
+    // cmd_words holds 2 slots per command Byte and at most as many per address Byte
+    if (cmd_len > FAST_SPI_MAX_CMD_LEN || addr_len > FAST_SPI_MAX_CMD_LEN - cmd_len || cmd_len + addr_len == 0) {
+        return false;
+    }
+    if (!sio_xfer_ok(handle, dummy_cycles, tx_buf, rx_buf, data_len)) {
+        return false;
+    }
+    if (handle->data_mode == fast_spi_data_mode_quad && addr_len % 2 != 0) {
+        return false;
+    }
+    uint32_t cmd_words[2*FAST_SPI_MAX_CMD_LEN];
+    size_t n = 0;
+    for (int i = 0; i < cmd_len; ++i) {
+        cmd_words[n++] = sio_expand(cmd_buf[i] >> 4, 1);
+        cmd_words[n++] = sio_expand(cmd_buf[i] & 0xF, 1);
+    }
+    // a dual slot carries a Byte, a quad slot 2
+    if (handle->data_mode == fast_spi_data_mode_quad) {
+        for (int i = 0; i < addr_len; i += 2) {
+            cmd_words[n++] = sio_expand((addr_buf[i] << 8) | addr_buf[i+1], 4);
+        }
+    } else {
+        for (int i = 0; i < addr_len; ++i) {
+            cmd_words[n++] = sio_dual_lut[addr_buf[i]];
+        }
+    }
+    sio_xfer(handle, cmd_words, n, cmd_len + addr_len, dummy_cycles, tx_buf, rx_buf, data_len);
+    return true;
+}
+
+extern unsigned spi_master_lanes_xfer(
+    port_t p_sck,
+    port_t p_miso,
+    port_t p_mosi,
+    port_t p_cs,
+    xclock_t clk_blk,
+    uint8_t* tx_buf,
+    uint8_t* rx_buf,
+    size_t xfer_len,
+    size_t input_time,
+    uint32_t clk_pattern,
+    uint32_t finish_cs_pattern,
+    uint32_t idle_clk_pattern
+);
+
+#define LANES_BYTE_SLOTS    40  // instruction slots of the spi_master_lanes_xfer loop, one Byte of every lane
+#define LANES_BYTE_TICKS    16  // port clock ticks of one Byte
+
+bool fast_spi_master_xfer_lanes(fast_spi_master_device_handle_t* handle, uint8_t* tx_buf, uint8_t* rx_buf, size_t xfer_len) {
+    if (xfer_len == 0 || handle->data_mode != fast_spi_data_mode_single || handle->frame != fast_spi_frame_msb8) {
+        return false;
+    }
+    // SCK and mosi stall when the loop falls behind but miso doesn't, a divider it can't keep up with reads garbage
+    if (LANES_BYTE_TICKS * handle->tick_core_clks < LANES_BYTE_SLOTS * FAST_SPI_LANES_ISSUE_CLKS) {
+        return false;
+    }
+    STATS_START();
+    port_out(handle->master->p_cs, handle->cs_bit_mask);
+    spi_master_lanes_xfer(
+        handle->master->p_sck,
+        handle->master->p_miso,
+        handle->master->p_mosi,
+        handle->master->p_cs,
+        handle->master->clk_blk,
+        tx_buf, rx_buf, xfer_len,
+        // a 4-bit port word is 8 ticks against the 32 input_delay is counted for
+        handle->input_delay - 24,
+        handle->clk_pattern, handle->master->cs_deassert_pattern,
+        handle->idle_clk_pattern
+    );
+    STATS_END(&handle->stats, FAST_SPI_LANES * xfer_len);
+    return true;
+}
 
 extern unsigned spi_slave_reg_xfer(
     port_t p_miso,
     port_t p_mosi,
     port_t p_cs,
-    void* reg_map,
+    fast_spi_slave_reg_banks_t* banks,
     size_t reg_map_len,
     size_t num_nop,
-    size_t miso_offset // set to non zero when clk to data timing can't match with desire clk rate, can't use when num_nop is not zero
+    size_t miso_offset, // set to non zero when clk to data timing can't match with desire clk rate, can't use when num_nop is not zero
+    chanend_t c_notify,
+    fast_spi_stats_t* stats,
+    volatile uint32_t* crc,
+    const uint32_t* volatile* region_map
 );
 
-static void set_pad_delay(port_t p, int pad_delay) {
-    int c_word = XS1_SETC_MODE_LONG;
-    c_word = XS1_SETC_LMODE_SET(c_word, XS1_SETC_LMODE_PIN_DELAY);
-    c_word = XS1_SETC_VALUE_SET(c_word, pad_delay);
-    // port_write_control_word(p, c_word);
-    asm volatile( "setc res[%0], %1" :: "r" (p), "r" (c_word));
-}
+typedef __typeof__(spi_slave_reg_xfer) slave_reg_kernel_t;
+DECLARE_FRAMED(slave_reg_kernel_t, spi_slave_reg_xfer);
+static slave_reg_kernel_t* const slave_reg_kernels[] = FRAMED(spi_slave_reg_xfer);
 
 // static void set_clk_rise_delay(xclock_t clk, int delay) {
 //     int c_word = XS1_SETC_MODE_LONG;
@@ -237,26 +1196,7 @@ static void set_pad_delay(port_t p, int pad_delay) {
 //     asm volatile( "setc res[%0], %1" :: "r" (clk), "r" (c_word));
 // }
 
-void fast_spi_slave_reg(
-    fast_spi_slave_reg_handle_t* handler,
-    port_t p_sck,
-    port_t p_mosi,
-    port_t p_miso,
-    port_t p_cs,
-    xclock_t cb_clk,
-    void* reg_map,
-    size_t reg_map_len,
-    int cpol,
-    int cpha,
-    size_t num_nop,
-    size_t miso_offset // set to non zero when clk to data timing can't match with desire clk rate, can't use when num_nop is not zero
-) {
-    handler->p_sck = p_sck;
-    handler->p_mosi = p_mosi;
-    handler->p_miso = p_miso;
-    handler->p_cs = p_cs;
-    handler->clk_blk = cb_clk;
-
+static uint32_t slave_setup_ports(port_t p_sck, port_t p_mosi, port_t p_miso, port_t p_cs, xclock_t cb_clk, int cpol, int cpha) {
     /* Setup the chip select port */
     port_enable(p_cs);
     port_set_invert(p_cs);
@@ -290,24 +1230,360 @@ void fast_spi_slave_reg(
     port_sync(p_sck);
 
     /* Wait until CS is not asserted to begin */
-    handler->cs_val = port_in_when_pinsneq(p_cs, PORT_UNBUFFERED, ASSERTED);
+    uint32_t cs_val = port_in_when_pinsneq(p_cs, PORT_UNBUFFERED, ASSERTED);
 
     triggerable_enable_trigger(p_cs);
-    port_set_trigger_in_not_equal(p_cs, handler->cs_val);
+    port_set_trigger_in_not_equal(p_cs, cs_val);
 
     triggerable_enable_trigger(p_mosi);
 
     set_pad_delay(p_mosi, 1);
 
-    spi_slave_reg_xfer(
+    return cs_val;
+}
+
+static void slave_crc_reset(fast_spi_slave_reg_handle_t* handler) {
+    memset(&handler->crc, 0, sizeof(handler->crc));
+    for (int i = 0; i < 3; ++i) {
+        handler->crc_state[i] = 0;
+    }
+}
+
+// access bits of a region_map entry, end offset << 8 | access, as spi_slave_reg_xfer.S reads them
+#define REGION_RD   0x01
+#define REGION_WR   0x02
+#define REGION_W1C  0x80
+
+static const uint32_t region_access[] = {
+    [fast_spi_slave_policy_rw] = REGION_RD | REGION_WR,
+    [fast_spi_slave_policy_ro] = REGION_RD,
+    [fast_spi_slave_policy_wo] = REGION_WR,
+    [fast_spi_slave_policy_w1c] = REGION_RD | REGION_WR | REGION_W1C,
+};
+
+static void slave_regions_reset(fast_spi_slave_reg_handle_t* handler) {
+    // offsets are 24 bit, a granule of 1 << 24 puts all of them in the one entry
+    handler->region_all[0] = 24;
+    handler->region_all[1] = (handler->reg_map_len << 8) | REGION_RD | REGION_WR;
+    handler->region_map = handler->region_all;
+}
+
+static void slave_reg_setup(
+    fast_spi_slave_reg_handle_t* handler,
+    port_t p_sck, port_t p_mosi, port_t p_miso, port_t p_cs, xclock_t cb_clk,
+    void* reg_map, size_t reg_map_len,
+    int cpol, int cpha,
+    size_t num_nop, size_t miso_offset, chanend_t c_notify, fast_spi_frame_t frame
+) {
+    handler->p_sck = p_sck;
+    handler->p_mosi = p_mosi;
+    handler->p_miso = p_miso;
+    handler->p_cs = p_cs;
+    handler->clk_blk = cb_clk;
+    handler->nop_cycle = num_nop*8+1;
+    handler->miso_offset = miso_offset;
+    handler->c_notify = c_notify;
+    handler->frame = frame;
+    if (reg_map != NULL) {
+        fast_spi_slave_reg_init(handler, reg_map, reg_map_len);
+    }
+
+    fast_spi_stats_reset(&handler->stats);
+    handler->cs_val = slave_setup_ports(p_sck, p_mosi, p_miso, p_cs, cb_clk, cpol, cpha);
+}
+
+#if FAST_SPI_STATS
+#define SLAVE_STATS(handler)    (&(handler)->stats)
+#else
+#define SLAVE_STATS(handler)    NULL
+#endif
+
+void fast_spi_slave_reg(
+    fast_spi_slave_reg_handle_t* handler,
+    port_t p_sck,
+    port_t p_mosi,
+    port_t p_miso,
+    port_t p_cs,
+    xclock_t cb_clk,
+    void* reg_map,
+    size_t reg_map_len,
+    int cpol,
+    int cpha,
+    size_t num_nop,
+    size_t miso_offset, // set to non zero when clk to data timing can't match with desire clk rate, can't use when num_nop is not zero
+    chanend_t c_notify,
+    fast_spi_frame_t frame
+) {
+    slave_reg_setup(handler, p_sck, p_mosi, p_miso, p_cs, cb_clk, reg_map, reg_map_len, cpol, cpha, num_nop, miso_offset, c_notify, frame);
+
+    slave_reg_kernels[frame](
         p_miso, p_mosi, p_cs,
-        reg_map, reg_map_len,
-        num_nop*8+1,
-        miso_offset
+        &handler->banks, handler->reg_map_len,
+        handler->nop_cycle,
+        miso_offset,
+        c_notify,
+        SLAVE_STATS(handler),
+        handler->crc_state,
+        &handler->region_map
+    );
+}
+
+DECLARE_FRAMED(slave_reg_kernel_t, spi_slave_reg_irq_xfer);
+extern slave_reg_kernel_t spi_slave_reg_irq_xfer;
+static slave_reg_kernel_t* const slave_reg_irq_kernels[] = FRAMED(spi_slave_reg_irq_xfer);
+
+DEFINE_INTERRUPT_CALLBACK(fast_spi_slave_irq, fast_spi_slave_reg_isr, arg) {
+    fast_spi_slave_reg_handle_t* handler = arg;
+    slave_reg_irq_kernels[handler->frame](
+        handler->p_miso, handler->p_mosi, handler->p_cs,
+        &handler->banks, handler->reg_map_len,
+        handler->nop_cycle,
+        handler->miso_offset,
+        handler->c_notify,
+        SLAVE_STATS(handler),
+        handler->crc_state,
+        &handler->region_map
     );
+    // the transaction ran p_cs on events, back to the interrupt for the next CS assert
+    triggerable_setup_interrupt_callback(handler->p_cs, handler, INTERRUPT_CALLBACK(fast_spi_slave_reg_isr));
+}
+
+void fast_spi_slave_reg_irq_start(
+    fast_spi_slave_reg_handle_t* handler,
+    port_t p_sck,
+    port_t p_mosi,
+    port_t p_miso,
+    port_t p_cs,
+    xclock_t cb_clk,
+    void* reg_map,
+    size_t reg_map_len,
+    int cpol,
+    int cpha,
+    size_t num_nop,
+    size_t miso_offset,
+    chanend_t c_notify,
+    fast_spi_frame_t frame
+) {
+    interrupt_mask_all();
+    slave_reg_setup(handler, p_sck, p_mosi, p_miso, p_cs, cb_clk, reg_map, reg_map_len, cpol, cpha, num_nop, miso_offset, c_notify, frame);
+    // p_mosi only takes events while a transaction is running in the interrupt
+    triggerable_disable_trigger(p_mosi);
+    triggerable_setup_interrupt_callback(p_cs, handler, INTERRUPT_CALLBACK(fast_spi_slave_reg_isr));
+    interrupt_unmask_all();
 }
 
+void fast_spi_slave_reg_irq_stop(fast_spi_slave_reg_handle_t* handler) {
+    triggerable_disable_trigger(handler->p_cs);
+}
 
-void spi_slave_update_reg(fast_spi_slave_reg_handle_t* handler, uint32_t addr, size_t len) {
-    // memcpy(&handler->reg_map->reg[addr], &handler->reg_map->shadow[addr], len);
-}
\ No newline at end of file
+void fast_spi_slave_reg_wait_write(chanend_t c, uint32_t* addr, size_t* len) {
+    *addr = s_chan_in_word(c);
+    *len = s_chan_in_word(c);
+}
+
+void fast_spi_slave_reg_set_crc(fast_spi_slave_reg_handle_t* handler, const fast_spi_crc_t* crc) {
+    handler->crc = *crc;
+    handler->crc_state[0] = crc_reflect(crc->poly, crc->width);
+    handler->crc_state[1] = crc_reflect(crc->init, crc->width);
+}
+
+uint32_t fast_spi_slave_reg_last_crc(fast_spi_slave_reg_handle_t* handler) {
+    if (handler->crc.width == 0) {
+        return 0;
+    }
+    return crc_final(&handler->crc, handler->crc_state[2]);
+}
+
+
+// spi_slave_reg_xfer reads these fields directly
+_Static_assert(offsetof(fast_spi_slave_reg_banks_t, cur) == 0 && offsetof(fast_spi_slave_reg_banks_t, in_use) == 4 &&
+               offsetof(fast_spi_slave_reg_banks_t, fast_rd) == 24 &&
+               offsetof(fast_spi_slave_reg_bank_t, reg) == 0 && offsetof(fast_spi_slave_reg_bank_t, mirror) == 4,
+               "fast_spi_slave_reg_banks_t layout doesn't match spi_slave_reg_xfer.S");
+_Static_assert(offsetof(fast_spi_stats_t, xfers) == 0 && offsetof(fast_spi_stats_t, rejects) == 4 &&
+               offsetof(fast_spi_stats_t, min_ticks) == 8 && offsetof(fast_spi_stats_t, max_ticks) == 12 &&
+               offsetof(fast_spi_stats_t, bytes) == 16 && offsetof(fast_spi_stats_t, total_ticks) == 24,
+               "fast_spi_stats_t layout doesn't match spi_slave_reg_xfer.S");
+
+void fast_spi_slave_reg_init(fast_spi_slave_reg_handle_t* handler, void* reg_map, size_t reg_map_len) {
+    // single buffered, both banks point at reg_map
+    handler->reg_map = reg_map;
+    handler->reg_map_len = reg_map_len;
+    handler->banks.bank[0].reg = reg_map;
+    handler->banks.bank[0].mirror = reg_map;
+    handler->banks.bank[1].reg = reg_map;
+    handler->banks.bank[1].mirror = reg_map;
+    handler->banks.cur = &handler->banks.bank[0];
+    handler->banks.in_use = NULL;
+    handler->banks.fast_rd = 0;
+    handler->shadow = NULL;
+    slave_crc_reset(handler);
+    slave_regions_reset(handler);
+}
+
+void fast_spi_slave_reg_init_double_buffer(fast_spi_slave_reg_handle_t* handler, void* reg_map, void* reg_map_b, void* shadow, size_t reg_map_len) {
+    memcpy(reg_map_b, reg_map, reg_map_len);
+    memcpy(shadow, reg_map, reg_map_len);
+    fast_spi_slave_reg_init(handler, reg_map, reg_map_len);
+    handler->banks.bank[0].mirror = reg_map_b;
+    handler->banks.bank[1].reg = reg_map_b;
+    handler->banks.bank[1].mirror = reg_map;
+    handler->shadow = shadow;
+}
+
+bool fast_spi_slave_reg_set_fast_rd(fast_spi_slave_reg_handle_t* handler, size_t addr) {
+    // the kernel loads 3 words from it without checking the end of reg_map
+    if ((addr & 3) != 0 || handler->reg_map_len < 12 || addr > handler->reg_map_len - 12) {
+        return false;
+    }
+    handler->banks.fast_rd = addr;
+    return true;
+}
+
+bool fast_spi_slave_reg_set_regions(
+    fast_spi_slave_reg_handle_t* handler, const fast_spi_slave_region_t* regions, size_t num_regions,
+    uint32_t* map, size_t map_len
+) {
+    size_t len = handler->reg_map_len;
+    if (num_regions == 0) {
+        slave_regions_reset(handler);
+        return true;
+    }
+    if (map == handler->region_map) {
+        return false;
+    }
+    uint32_t bounds = 0;
+    for (size_t i = 0; i < num_regions; ++i) {
+        size_t start = regions[i].start;
+        size_t end = start + regions[i].len;
+        if (regions[i].len == 0 || end > len || end < start || regions[i].policy > fast_spi_slave_policy_w1c) {
+            return false;
+        }
+        bounds |= start;
+        if (end != len) {
+            bounds |= end;
+        }
+    }
+    // the kernel stores whole words, a region boundary inside one would let a write spill over it
+    uint32_t shift = bounds ? __builtin_ctz(bounds) : 24;
+    if (shift < 2) {
+        return false;
+    }
+    if (shift > 24) {
+        shift = 24;
+    }
+    size_t granules = (len + (1u << shift) - 1) >> shift;
+    if (map_len < granules + 1) {
+        return false;
+    }
+    // 0 is no access
+    memset(&map[1], 0, granules * sizeof(uint32_t));
+    for (size_t i = 0; i < num_regions; ++i) {
+        size_t end = regions[i].start + regions[i].len;
+        uint32_t entry = (end << 8) | region_access[regions[i].policy];
+        for (size_t g = regions[i].start >> shift; g < (end + (1u << shift) - 1) >> shift; ++g) {
+            if (map[1 + g] != 0) {
+                return false;
+            }
+            map[1 + g] = entry;
+        }
+    }
+    map[0] = shift;
+    handler->region_map = map;
+    return true;
+}
+
+void fast_spi_slave_update_reg(fast_spi_slave_reg_handle_t* handler, uint32_t addr, size_t len) {
+    fast_spi_slave_reg_banks_t* banks = &handler->banks;
+    if (handler->shadow == NULL || addr >= handler->reg_map_len) {
+        return;
+    }
+    if (len > handler->reg_map_len - addr) {
+        len = handler->reg_map_len - addr;
+    }
+    fast_spi_slave_reg_bank_t* old_bank = banks->cur;
+    fast_spi_slave_reg_bank_t* new_bank = old_bank == &banks->bank[0] ? &banks->bank[1] : &banks->bank[0];
+    // the idle bank only takes host writes as a mirror, fill it and make it current
+    memcpy(&new_bank->reg[addr], &handler->shadow[addr], len);
+    banks->cur = new_bank;
+    // a transaction that picked the old bank keeps reading it until CS goes high
+    while (banks->in_use == old_bank->reg) {
+    }
+    // host writes since the first copy went to both banks or to new_bank alone, new_bank has them all
+    memcpy(&old_bank->reg[addr], &new_bank->reg[addr], len);
+}
+
+extern unsigned spi_slave_stream_xfer(
+    port_t p_miso,
+    port_t p_mosi,
+    port_t p_cs,
+    fast_spi_slave_stream_t* stream
+);
+
+// spi_slave_stream_xfer reads and writes these fields directly
+_Static_assert(offsetof(fast_spi_slave_stream_t, rx_buf) == 0 && offsetof(fast_spi_slave_stream_t, rx_head) == 8 &&
+               offsetof(fast_spi_slave_stream_t, tx_buf) == 16 && offsetof(fast_spi_slave_stream_t, tx_tail) == 28 &&
+               offsetof(fast_spi_slave_stream_t, rx_partial) == 40 && offsetof(fast_spi_slave_stream_t, tx_dropped) == 44,
+               "fast_spi_slave_stream_t layout doesn't match spi_slave_stream_xfer.S");
+
+void fast_spi_slave_stream_init(fast_spi_slave_stream_t* stream, uint32_t* rx_buf, size_t rx_words, uint32_t* tx_buf, size_t tx_words) {
+    stream->rx_buf = rx_buf;
+    stream->rx_mask = rx_words - 1;
+    stream->rx_head = 0;
+    stream->rx_tail = 0;
+    stream->tx_buf = tx_buf;
+    stream->tx_mask = tx_buf != NULL ? tx_words - 1 : 0;
+    stream->tx_head = 0;
+    stream->tx_tail = 0;
+    stream->rx_overrun = 0;
+    stream->tx_underrun = 0;
+    stream->rx_partial = 0;
+    stream->tx_dropped = 0;
+}
+
+void fast_spi_slave_stream(
+    fast_spi_slave_stream_t* stream,
+    port_t p_sck,
+    port_t p_mosi,
+    port_t p_miso,
+    port_t p_cs,
+    xclock_t cb_clk,
+    int cpol,
+    int cpha
+) {
+    slave_setup_ports(p_sck, p_mosi, p_miso, p_cs, cb_clk, cpol, cpha);
+    spi_slave_stream_xfer(p_miso, p_mosi, p_cs, stream);
+}
+
+size_t fast_spi_slave_stream_read(fast_spi_slave_stream_t* stream, uint32_t* words, size_t max_words) {
+    uint32_t tail = stream->rx_tail;
+    size_t num = stream->rx_head - tail;
+    if (num > max_words) {
+        num = max_words;
+    }
+    for (size_t i = 0; i < num; ++i) {
+        words[i] = stream->rx_buf[(tail + i) & stream->rx_mask];
+    }
+    // words have to be copied out before the slave can reuse their slots
+    asm volatile("" ::: "memory");
+    stream->rx_tail = tail + num;
+    return num;
+}
+
+size_t fast_spi_slave_stream_write(fast_spi_slave_stream_t* stream, const uint32_t* words, size_t num_words) {
+    uint32_t head = stream->tx_head;
+    size_t space = stream->tx_mask + 1 - (head - stream->tx_tail);
+    if (stream->tx_buf == NULL) {
+        return 0;
+    }
+    if (num_words > space) {
+        num_words = space;
+    }
+    for (size_t i = 0; i < num_words; ++i) {
+        stream->tx_buf[(head + i) & stream->tx_mask] = words[i];
+    }
+    // words have to be in place before the slave can see the new head
+    asm volatile("" ::: "memory");
+    stream->tx_head = head + num_words;
+    return num_words;
+}
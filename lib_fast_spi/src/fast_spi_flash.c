@@ -0,0 +1,252 @@
+#include "fast_spi.h"
+#include <stddef.h>
+#include <string.h>
+#include <xcore/hwtimer.h>
+
+/*
+ * Short commands go through fast_spi_master_xfer on a word, a program is a
+ * fast_spi_master_xfer_sg of the header word and the page data. Single reads
+ * are an sg of the 0x0B header and dst, so the data lands in the caller's
+ * buffer in the same CS window. Wide reads take the address 1-bit with
+ * 0x3B/0x6B, or in quad (with the mode Byte) with 0xEB. Once a 0xEB read sent
+ * MODE_CONT the flash takes the next read without command Byte, a read with
+ * MODE_END ends that, and has to come before any other command.
+ */
+
+#define CMD_WREN        0x06
+#define CMD_RDSR        0x05
+#define CMD_PP          0x02
+#define CMD_SE          0x20
+#define CMD_BE32        0x52
+#define CMD_BE64        0xD8
+#define CMD_CE          0xC7
+#define CMD_RDID        0x9F
+#define CMD_RES         0xAB
+#define CMD_FAST_READ   0x0B
+#define CMD_DUAL_READ   0x3B
+#define CMD_QUAD_READ   0x6B
+#define CMD_QUAD_IO     0xEB
+
+#define SR_WIP          0x01
+
+#define MODE_CONT       0xA5
+#define MODE_END        0x00
+
+#define READ_DUMMY      8   // SCK cycles of 0x0B/0x3B/0x6B
+#define QUAD_IO_DUMMY   4   // SCK cycles of 0xEB after the mode Byte
+
+#define RES_TICKS       300 // tRES1, 3us of reference clock
+
+static void flash_delay(uint32_t ticks) {
+    hwtimer_t tmr = hwtimer_alloc();
+    hwtimer_delay(tmr, ticks);
+    hwtimer_free(tmr);
+}
+
+// the command Byte first, then up to 3 more
+static uint32_t flash_cmd(fast_spi_flash_t* flash, uint8_t cmd, uint32_t arg, size_t len) {
+    uint32_t tx = cmd | (arg >> 16 & 0xFF) << 8 | (arg >> 8 & 0xFF) << 16 | (arg & 0xFF) << 24;
+    uint32_t rx = 0;
+    fast_spi_master_init_xfer(flash->dev);
+    fast_spi_master_xfer(flash->dev, (uint8_t*)&tx, (uint8_t*)&rx, len);
+    return rx;
+}
+
+static bool wide_read(fast_spi_flash_t* flash, uint32_t addr, uint8_t* dst, size_t len, uint8_t mode) {
+    uint8_t cmd[4] = {flash->read_cmd, addr >> 16, addr >> 8, addr};
+    fast_spi_master_init_xfer(flash->wide);
+    if (flash->read_cmd != CMD_QUAD_IO) {
+        return fast_spi_master_xfer_wide(flash->wide, cmd, 4, READ_DUMMY, NULL, dst, len);
+    }
+    uint8_t addr_mode[4] = {addr >> 16, addr >> 8, addr, mode};
+    if (!fast_spi_master_xfer_wide_io(
+        flash->wide, cmd, flash->in_continuous ? 0 : 1, addr_mode, 4, QUAD_IO_DUMMY, NULL, dst, len
+    )) {
+        return false;
+    }
+    flash->in_continuous = mode == MODE_CONT;
+    return true;
+}
+
+static void end_continuous(fast_spi_flash_t* flash) {
+    if (flash->in_continuous) {
+        uint32_t word;
+        wide_read(flash, 0, (uint8_t*)&word, 2, MODE_END);
+    }
+}
+
+// the flash takes no other command while it is busy or in continuous mode
+static void flash_idle(fast_spi_flash_t* flash) {
+    end_continuous(flash);
+    fast_spi_flash_wait(flash);
+}
+
+bool fast_spi_flash_init(fast_spi_flash_t* flash, fast_spi_master_device_handle_t* dev, fast_spi_master_device_handle_t* wide) {
+    flash->dev = dev;
+    flash->wide = wide != NULL && wide->data_mode != fast_spi_data_mode_single ? wide : NULL;
+    flash->continuous = false;
+    flash->in_continuous = false;
+    flash->busy = false;
+    flash->read_cmd = CMD_FAST_READ;
+    if (flash->wide != NULL) {
+        flash->read_cmd = flash->wide->data_mode == fast_spi_data_mode_quad ? CMD_QUAD_READ : CMD_DUAL_READ;
+    }
+
+    // 0xFF where the mode Byte would be ends a continuous read left over from before a reset
+    flash_cmd(flash, 0xFF, 0xFF0000, 2);
+    flash_cmd(flash, CMD_RES, 0, 1);
+    flash_delay(RES_TICKS);
+    uint32_t id = flash_cmd(flash, CMD_RDID, 0, 4) >> 8;
+    flash->jedec_id[0] = id & 0xFF;
+    flash->jedec_id[1] = (id >> 8) & 0xFF;
+    flash->jedec_id[2] = (id >> 16) & 0xFF;
+    if (id == 0 || id == 0xFFFFFF) {
+        return false;
+    }
+    // 2^capacity Bytes, what 24 bit addresses reach of larger parts
+    unsigned capacity = flash->jedec_id[2];
+    if (capacity < 0x10 || capacity > 0x20) {
+        return false;
+    }
+    flash->size = 1u << (capacity > 24 ? 24 : capacity);
+    return true;
+}
+
+bool fast_spi_flash_set_continuous(fast_spi_flash_t* flash, bool on) {
+    if (flash->wide == NULL || flash->wide->data_mode != fast_spi_data_mode_quad) {
+        return false;
+    }
+    if (!on) {
+        end_continuous(flash);
+    }
+    flash->continuous = on;
+    flash->read_cmd = on ? CMD_QUAD_IO : CMD_QUAD_READ;
+    return true;
+}
+
+bool fast_spi_flash_read(fast_spi_flash_t* flash, uint32_t addr, uint8_t* dst, size_t len) {
+    if (addr > flash->size || len > flash->size - addr) {
+        return false;
+    }
+    if (len == 0) {
+        return true;
+    }
+    fast_spi_flash_wait(flash);
+    if (flash->wide == NULL) {
+        uint32_t hdr[2];
+        ((uint8_t*)hdr)[0] = CMD_FAST_READ;
+        ((uint8_t*)hdr)[1] = addr >> 16;
+        ((uint8_t*)hdr)[2] = addr >> 8;
+        ((uint8_t*)hdr)[3] = addr;
+        ((uint8_t*)hdr)[4] = 0;     // READ_DUMMY cycles
+        fast_spi_seg_t segs[2] = {
+            {(uint8_t*)hdr, NULL, 5},
+            {NULL, dst, len}
+        };
+        fast_spi_master_init_xfer(flash->dev);
+        return fast_spi_master_xfer_sg(flash->dev, segs, 2);
+    }
+    uint8_t mode = flash->continuous ? MODE_CONT : MODE_END;
+    size_t even = flash->wide->data_mode == fast_spi_data_mode_quad ? len & ~1 : len;
+    if (even != 0 && !wide_read(flash, addr, dst, even, mode)) {
+        return false;
+    }
+    if (even != len) {
+        // a quad slot is 2 Bytes, the odd last one comes on its own
+        uint32_t word;
+        if (!wide_read(flash, addr + even, (uint8_t*)&word, 2, mode)) {
+            return false;
+        }
+        dst[even] = word & 0xFF;
+    }
+    return true;
+}
+
+size_t fast_spi_flash_program(fast_spi_flash_t* flash, uint32_t addr, const uint8_t* src, size_t len) {
+    if (addr >= flash->size || len == 0) {
+        return 0;
+    }
+    size_t page_left = FAST_SPI_FLASH_PAGE_LEN - (addr & (FAST_SPI_FLASH_PAGE_LEN - 1));
+    if (len > page_left) {
+        len = page_left;
+    }
+    flash_idle(flash);
+    if ((uintptr_t)src & 3) {
+        memcpy(flash->page, src, len);
+        src = (const uint8_t*)flash->page;
+    }
+    flash_cmd(flash, CMD_WREN, 0, 1);
+    uint32_t hdr = CMD_PP | (addr >> 16 & 0xFF) << 8 | (addr >> 8 & 0xFF) << 16 | (addr & 0xFF) << 24;
+    fast_spi_seg_t segs[2] = {
+        {(uint8_t*)&hdr, NULL, 4},
+        {src, NULL, len}
+    };
+    fast_spi_master_xfer_sg(flash->dev, segs, 2);
+    flash->busy = true;
+    return len;
+}
+
+bool fast_spi_flash_erase(fast_spi_flash_t* flash, uint32_t addr, size_t len) {
+    if ((addr | len) & 0xFFF || addr > flash->size || len > flash->size - addr) {
+        return false;
+    }
+    // CE erases all of the part, past 16MB that is more than 24 bit addresses reach and it takes block erases
+    if (addr == 0 && len == flash->size && flash->jedec_id[2] <= 24) {
+        flash_idle(flash);
+        flash_cmd(flash, CMD_WREN, 0, 1);
+        flash_cmd(flash, CMD_CE, 0, 1);
+        flash->busy = true;
+        return true;
+    }
+    while (len != 0) {
+        // largest block that starts at addr and fits
+        uint8_t cmd = CMD_SE;
+        size_t block = 0x1000;
+        if ((addr & 0xFFFF) == 0 && len >= 0x10000) {
+            cmd = CMD_BE64;
+            block = 0x10000;
+        } else if ((addr & 0x7FFF) == 0 && len >= 0x8000) {
+            cmd = CMD_BE32;
+            block = 0x8000;
+        }
+        flash_idle(flash);
+        flash_cmd(flash, CMD_WREN, 0, 1);
+        flash_cmd(flash, cmd, addr, 4);
+        flash->busy = true;
+        addr += block;
+        len -= block;
+    }
+    return true;
+}
+
+bool fast_spi_flash_poll(fast_spi_flash_t* flash) {
+    if (flash->busy && !(flash_cmd(flash, CMD_RDSR, 0, 2) >> 8 & SR_WIP)) {
+        flash->busy = false;
+    }
+    return !flash->busy;
+}
+
+void fast_spi_flash_wait(fast_spi_flash_t* flash) {
+    if (fast_spi_flash_poll(flash)) {
+        return;
+    }
+    hwtimer_t tmr = hwtimer_alloc();
+    do {
+        hwtimer_delay(tmr, FAST_SPI_FLASH_POLL_TICKS);
+    } while (!fast_spi_flash_poll(flash));
+    hwtimer_free(tmr);
+}
+
+bool fast_spi_flash_write(fast_spi_flash_t* flash, uint32_t addr, const uint8_t* src, size_t len) {
+    if (addr > flash->size || len > flash->size - addr) {
+        return false;
+    }
+    while (len != 0) {
+        size_t n = fast_spi_flash_program(flash, addr, src, len);
+        addr += n;
+        src += n;
+        len -= n;
+    }
+    fast_spi_flash_wait(flash);
+    return true;
+}
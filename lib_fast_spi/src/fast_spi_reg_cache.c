@@ -0,0 +1,164 @@
+#include "fast_spi.h"
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Every xfer is a fast_spi_master_xfer_sg of 2 segments: the header from the
+ * start of buf (command, 24 bit address LSB first, num_nop zeros) and the data
+ * from the word after it, both word aligned whatever the register address is.
+ */
+
+#define CMD_WR_DATA     0x03
+#define CMD_RD_DATA     0x04
+
+#define HDR_LEN(cache)  (4 + (cache)->num_nop)
+
+static size_t clamp_len(fast_spi_reg_cache_t* cache, uint32_t addr, size_t len) {
+    if (addr >= cache->len) {
+        return 0;
+    }
+    if (len > cache->len - addr) {
+        len = cache->len - addr;
+    }
+    return len;
+}
+
+static void cache_xfer(fast_spi_reg_cache_t* cache, uint8_t cmd, uint32_t addr, bool read, size_t len) {
+    uint8_t* hdr = (uint8_t*)cache->buf;
+    uint8_t* data = (uint8_t*)&cache->buf[cache->hdr_words];
+    hdr[0] = cmd;
+    hdr[1] = addr & 0xFF;
+    hdr[2] = (addr >> 8) & 0xFF;
+    hdr[3] = (addr >> 16) & 0xFF;
+    fast_spi_seg_t segs[2] = {
+        {hdr, NULL, HDR_LEN(cache)},
+        {read ? NULL : data, read ? data : NULL, len}
+    };
+    fast_spi_master_xfer_sg(cache->dev, segs, 2);
+    cache->xfers++;
+}
+
+void fast_spi_reg_cache_init(
+    fast_spi_reg_cache_t* cache,
+    fast_spi_master_device_handle_t* dev,
+    uint8_t* shadow, uint8_t* flags, size_t len,
+    size_t num_nop,
+    uint32_t* buf, size_t buf_words
+) {
+    cache->dev = dev;
+    cache->shadow = shadow;
+    cache->flags = flags;
+    cache->len = len;
+    cache->num_nop = num_nop;
+    cache->buf = buf;
+    cache->hdr_words = (4 + num_nop + 3) / 4;
+    cache->max_burst = (buf_words - cache->hdr_words) * 4;
+    cache->dirty_lo = len;
+    cache->dirty_hi = 0;
+    cache->xfers = 0;
+    memset(flags, 0, len);
+    // NOP Bytes of the header go out as zeros
+    memset(buf, 0, cache->hdr_words * 4);
+}
+
+void fast_spi_reg_cache_set_volatile(fast_spi_reg_cache_t* cache, uint32_t addr, size_t len) {
+    len = clamp_len(cache, addr, len);
+    for (size_t i = addr; i < addr + len; ++i) {
+        cache->flags[i] = (cache->flags[i] | FAST_SPI_REG_VOLATILE) & ~FAST_SPI_REG_VALID;
+    }
+}
+
+void fast_spi_reg_cache_write(fast_spi_reg_cache_t* cache, uint32_t addr, const void* data, size_t len) {
+    len = clamp_len(cache, addr, len);
+    if (len == 0) {
+        return;
+    }
+    memcpy(&cache->shadow[addr], data, len);
+    for (size_t i = addr; i < addr + len; ++i) {
+        cache->flags[i] |= FAST_SPI_REG_DIRTY;
+    }
+    if (addr < cache->dirty_lo) {
+        cache->dirty_lo = addr;
+    }
+    if (addr + len > cache->dirty_hi) {
+        cache->dirty_hi = addr + len;
+    }
+}
+
+// a clean Byte can go out again inside a burst when the slave already has the same value
+static bool gap_ok(uint8_t flags) {
+    return (flags & (FAST_SPI_REG_VALID | FAST_SPI_REG_VOLATILE)) == FAST_SPI_REG_VALID;
+}
+
+void fast_spi_reg_cache_flush(fast_spi_reg_cache_t* cache) {
+    uint8_t* flags = cache->flags;
+    size_t i = cache->dirty_lo;
+    size_t hi = cache->dirty_hi;
+    while (i < hi) {
+        if (!(flags[i] & FAST_SPI_REG_DIRTY)) {
+            ++i;
+            continue;
+        }
+        // grow the run over dirty Bytes and short gaps of clean ones
+        size_t start = i;
+        size_t end = i + 1;
+        size_t j = end;
+        while (j < hi && j - start < cache->max_burst) {
+            if (flags[j] & FAST_SPI_REG_DIRTY) {
+                end = ++j;
+            } else if (gap_ok(flags[j]) && j - end < FAST_SPI_REG_CACHE_MAX_GAP) {
+                ++j;
+            } else {
+                break;
+            }
+        }
+        memcpy(&cache->buf[cache->hdr_words], &cache->shadow[start], end - start);
+        cache_xfer(cache, CMD_WR_DATA, start, false, end - start);
+        for (j = start; j < end; ++j) {
+            // written values stay known, unless the slave changes them on its own
+            flags[j] = (flags[j] & ~FAST_SPI_REG_DIRTY) | ((flags[j] & FAST_SPI_REG_VOLATILE) ? 0 : FAST_SPI_REG_VALID);
+        }
+        i = end;
+    }
+    cache->dirty_lo = cache->len;
+    cache->dirty_hi = 0;
+}
+
+// shadow has the latest value, either from the slave or not flushed yet
+static bool local_ok(uint8_t flags) {
+    return !(flags & FAST_SPI_REG_VOLATILE) && (flags & (FAST_SPI_REG_VALID | FAST_SPI_REG_DIRTY));
+}
+
+void fast_spi_reg_cache_read(fast_spi_reg_cache_t* cache, uint32_t addr, void* data, size_t len) {
+    len = clamp_len(cache, addr, len);
+    size_t i = addr;
+    while (i < addr + len && local_ok(cache->flags[i])) {
+        ++i;
+    }
+    if (i < addr + len) {
+        fast_spi_reg_cache_flush(cache);
+        // one burst from the first Byte not known locally to the end of the range
+        while (i < addr + len) {
+            size_t n = addr + len - i;
+            if (n > cache->max_burst) {
+                n = cache->max_burst;
+            }
+            cache_xfer(cache, CMD_RD_DATA, i, true, n);
+            memcpy(&cache->shadow[i], &cache->buf[cache->hdr_words], n);
+            for (size_t j = i; j < i + n; ++j) {
+                if (!(cache->flags[j] & FAST_SPI_REG_VOLATILE)) {
+                    cache->flags[j] |= FAST_SPI_REG_VALID;
+                }
+            }
+            i += n;
+        }
+    }
+    memcpy(data, &cache->shadow[addr], len);
+}
+
+void fast_spi_reg_cache_invalidate(fast_spi_reg_cache_t* cache, uint32_t addr, size_t len) {
+    len = clamp_len(cache, addr, len);
+    for (size_t i = addr; i < addr + len; ++i) {
+        cache->flags[i] &= ~FAST_SPI_REG_VALID;
+    }
+}
@@ -0,0 +1,199 @@
+#include "fast_spi.h"
+#include <stddef.h>
+#include <string.h>
+#include <xcore/channel_streaming.h>
+#include <xcore/clock.h>
+#include <xcore/hwtimer.h>
+#include <xcore/select.h>
+#include <xcore/thread.h>
+
+/*
+ * Port time counts port clock ticks from the clock block start, and with a reference clock source a tick is a
+ * fixed number of reference clock ticks. (base, base_pt) is one matching pair of the 2, moved up to the last
+ * instant each time so the 16 bit port time never has to cover more than the lead time.
+ */
+
+// from the port time being set to the first setpt of spi_master_list_xfer_at, in reference clock ticks
+#define LAUNCH_TICKS    100
+
+extern unsigned spi_master_list_xfer_at(
+    port_t p_sck,
+    port_t p_miso,
+    port_t p_mosi,
+    port_t p_cs,
+    xclock_t clk_blk,
+    fast_spi_master_device_handle_t** devices,
+    fast_spi_xfer_t* xfers,
+    size_t num_xfers,
+    size_t input_delay,
+    uint32_t finish_cs_pattern,
+    uint32_t idle_clk_pattern,
+    size_t gap,
+    size_t start
+);
+
+// the pad delay is set once as the task starts, input_delay goes with every entry
+static bool same_bus(fast_spi_master_device_handle_t* a, fast_spi_master_device_handle_t* b) {
+    return a->master == b->master &&
+           a->clk_blk == b->clk_blk &&
+           a->clk_src == b->clk_src &&
+           a->clk_divider == b->clk_divider &&
+           a->sck_invert == b->sck_invert &&
+           a->idle_clk_pattern == b->idle_clk_pattern &&
+           a->miso_pad_delay == b->miso_pad_delay &&
+           a->data_mode == b->data_mode &&
+           a->frame == b->frame;
+}
+
+bool fast_spi_sched_init(
+    fast_spi_sched_t* sched, fast_spi_master_device_handle_t** devices,
+    fast_spi_sched_entry_t* entries, size_t num_entries, chanend_t c_ctrl
+) {
+    if (num_entries == 0) {
+        return false;
+    }
+    fast_spi_master_device_handle_t* dev = devices[entries[0].dev_id];
+    if (dev->clk_src != fast_spi_clock_source_ref_clk || dev->data_mode != fast_spi_data_mode_single ||
+        dev->frame != fast_spi_frame_msb8) {
+        return false;
+    }
+    for (size_t i = 1; i < num_entries; ++i) {
+        if (!same_bus(dev, devices[entries[i].dev_id])) {
+            return false;
+        }
+    }
+    sched->devices = devices;
+    sched->entries = entries;
+    sched->num_entries = num_entries;
+    sched->c_ctrl = c_ctrl;
+    // clock block divider d gives ref/2d, 0 passes ref through
+    sched->ref_per_tick = dev->clk_divider ? 2 * dev->clk_divider : 1;
+    sched->late = 0;
+    sched->max_late_ticks = 0;
+    for (size_t i = 0; i < num_entries; ++i) {
+        entries[i].seq = 0;
+        entries[i].time[0] = 0;
+        entries[i].time[1] = 0;
+        entries[i].missed = 0;
+    }
+    return true;
+}
+
+static fast_spi_sched_entry_t* sched_next(fast_spi_sched_t* sched) {
+    fast_spi_sched_entry_t* next = &sched->entries[0];
+    for (size_t i = 1; i < sched->num_entries; ++i) {
+        if ((int32_t)(sched->entries[i].due - next->due) < 0) {
+            next = &sched->entries[i];
+        }
+    }
+    return next;
+}
+
+static void sched_launch(fast_spi_sched_t* sched, fast_spi_sched_entry_t* entry) {
+    fast_spi_master_device_handle_t* dev = sched->devices[entry->dev_id];
+    uint32_t at = entry->due;
+    uint32_t now = get_reference_time();
+    if ((int32_t)(at - now) < LAUNCH_TICKS) {
+        at = now + LAUNCH_TICKS;
+        sched->late++;
+        if (at - entry->due > sched->max_late_ticks) {
+            sched->max_late_ticks = at - entry->due;
+        }
+    }
+    // round up to the next port clock tick and make that the new base
+    uint32_t ticks = (at - sched->base + sched->ref_per_tick - 1) / sched->ref_per_tick;
+    sched->base += ticks * sched->ref_per_tick;
+    sched->base_pt = (sched->base_pt + ticks) & 0xFFFF;
+
+    uint32_t buf = entry->seq & 1;
+    fast_spi_xfer_t xfer = {entry->dev_id, entry->tx_buf, entry->rx_buf[buf], entry->len};
+    spi_master_list_xfer_at(
+        dev->master->p_sck,
+        dev->master->p_miso,
+        dev->master->p_mosi,
+        dev->master->p_cs,
+        dev->master->clk_blk,
+        sched->devices, &xfer, 1,
+        dev->input_delay, dev->master->cs_deassert_pattern,
+        dev->idle_clk_pattern,
+        FAST_SPI_LIST_GAP_TICKS,
+        sched->base_pt
+    );
+    // time goes with its rx_buf, a reader pairs both through the same seq
+    entry->time[buf] = sched->base;
+    entry->seq++;
+
+    // stay on the grid, an entry more than a period behind drops the instants it missed
+    entry->due += entry->period;
+    now = get_reference_time();
+    while ((int32_t)(entry->due - now) < 0) {
+        entry->due += entry->period;
+        entry->missed++;
+    }
+}
+
+void fast_spi_sched_task(fast_spi_sched_t* sched) {
+    local_thread_mode_set_bits(thread_mode_high_priority);
+    fast_spi_master_device_handle_t* dev = sched->devices[sched->entries[0].dev_id];
+    hwtimer_t tmr = hwtimer_alloc();
+
+    fast_spi_master_init_xfer(dev);
+    uint32_t start = get_reference_time() + 2 * FAST_SPI_SCHED_LEAD_TICKS;
+    for (size_t i = 0; i < sched->num_entries; ++i) {
+        sched->entries[i].due = start + sched->entries[i].phase;
+    }
+    // port time 0 from here on, the gettime right after the setc is within a reference clock tick of it
+    clock_start(dev->master->clk_blk);
+    sched->base = get_reference_time();
+    sched->base_pt = 0;
+
+    // paused on the timer until the next xfer is close
+    fast_spi_sched_entry_t* next = sched_next(sched);
+    hwtimer_set_trigger_time(tmr, next->due - FAST_SPI_SCHED_LEAD_TICKS);
+    bool running = true;
+    while (running) {
+        SELECT_RES(
+            CASE_THEN(tmr, on_timer),
+            CASE_THEN(sched->c_ctrl, on_stop)
+        ) {
+        on_timer:
+            hwtimer_get_time(tmr);
+            sched_launch(sched, next);
+            next = sched_next(sched);
+            hwtimer_set_trigger_time(tmr, next->due - FAST_SPI_SCHED_LEAD_TICKS);
+            continue;
+        on_stop:
+            s_chan_in_word(sched->c_ctrl);
+            running = false;
+            break;
+        }
+    }
+
+    hwtimer_clear_trigger_time(tmr);
+    hwtimer_free(tmr);
+    clock_stop(dev->master->clk_blk);
+    s_chan_out_word(sched->c_ctrl, 0);
+}
+
+void fast_spi_sched_stop(chanend_t c) {
+    s_chan_out_word(c, 0);
+    s_chan_in_word(c);
+}
+
+uint32_t fast_spi_sched_read(const fast_spi_sched_entry_t* entry, void* dst, uint32_t* time) {
+    uint32_t seq;
+    uint32_t t;
+    do {
+        // rx_buf[(seq - 1) & 1] and its time are only written again after seq moves on
+        seq = entry->seq;
+        if (seq == 0) {
+            return 0;
+        }
+        t = entry->time[(seq - 1) & 1];
+        memcpy(dst, entry->rx_buf[(seq - 1) & 1], entry->len);
+    } while (entry->seq != seq);
+    if (time != NULL) {
+        *time = t;
+    }
+    return seq;
+}
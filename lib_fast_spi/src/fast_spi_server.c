@@ -0,0 +1,308 @@
+#include "fast_spi.h"
+#include <stddef.h>
+#include <string.h>
+#include <xcore/chanend.h>
+#include <xcore/select.h>
+#include <xcore/thread.h>
+
+/*
+ * Local clients push into their own ring (single producer, single consumer) and
+ * ring the server with an END token on c_req. Remote clients send the whole xfer
+ * over c_req: reply chanend, dev_id, flags, len, tx words, END.
+ * Completions go back through c_reply, an END token for local clients, a status
+ * word, the rx words and an END token for remote clients. A request that doesn't
+ * fit a slot is drained and answered with REMOTE_REJECT straight away. While all
+ * remote slots are taken the server leaves the next request in c_req, the client
+ * waits in its chanend_out until a slot is free again.
+ */
+
+#define REMOTE_HAS_TX   0x1
+#define REMOTE_HAS_RX   0x2
+
+#define REMOTE_OK       0
+#define REMOTE_REJECT   1
+
+#define NUM_WORDS(len)  (((len) + 3) / 4)
+
+_Static_assert((FAST_SPI_SERVER_QUEUE_LEN & (FAST_SPI_SERVER_QUEUE_LEN - 1)) == 0 && FAST_SPI_SERVER_QUEUE_LEN <= 8,
+               "completions of a full ring must fit in the client chanend buffer");
+
+void fast_spi_master_server_init(fast_spi_master_server_t* srv, fast_spi_master_device_handle_t** devices, size_t num_devices) {
+    srv->c_req = chanend_alloc();
+    srv->c_reply = chanend_alloc();
+    srv->devices = devices;
+    srv->num_devices = num_devices;
+    srv->current = NULL;
+    srv->num_clients = 0;
+    for (int i = 0; i < FAST_SPI_SERVER_MAX_REMOTE; ++i) {
+        srv->remote[i].reply_to = 0;
+    }
+    srv->next = 0;
+    srv->batch = 0;
+    srv->queue_depth = 0;
+    srv->max_queue_depth = 0;
+    srv->device_switches = 0;
+}
+
+static fast_spi_remote_slot_t* server_free_slot(fast_spi_master_server_t* srv) {
+    for (int i = 0; i < FAST_SPI_SERVER_MAX_REMOTE; ++i) {
+        if (srv->remote[i].reply_to == 0) {
+            return &srv->remote[i];
+        }
+    }
+    return NULL;
+}
+
+static void server_recv_remote(fast_spi_master_server_t* srv, fast_spi_remote_slot_t* slot) {
+    chanend_t reply_to = chanend_in_word(srv->c_req);
+    size_t dev_id = chanend_in_word(srv->c_req);
+    uint32_t flags = chanend_in_word(srv->c_req);
+    size_t len = chanend_in_word(srv->c_req);
+    if (dev_id >= srv->num_devices || len == 0 || len > FAST_SPI_SERVER_REMOTE_MAX_LEN) {
+        while (!chanend_test_control_token_next_byte(srv->c_req)) {
+            chanend_in_byte(srv->c_req);
+        }
+        chanend_check_end_token(srv->c_req);
+        chanend_set_dest(srv->c_reply, reply_to);
+        chanend_out_word(srv->c_reply, REMOTE_REJECT);
+        chanend_out_end_token(srv->c_reply);
+        return;
+    }
+    if (flags & REMOTE_HAS_TX) {
+        for (int i = 0; i < NUM_WORDS(len); ++i) {
+            slot->tx_buf[i] = chanend_in_word(srv->c_req);
+        }
+    }
+    chanend_check_end_token(srv->c_req);
+    slot->dev_id = dev_id;
+    slot->has_tx = (flags & REMOTE_HAS_TX) != 0;
+    slot->has_rx = (flags & REMOTE_HAS_RX) != 0;
+    slot->len = len;
+    slot->reply_to = reply_to;
+}
+
+// false when a remote request has to wait for a free slot, it stays in c_req
+static bool server_recv(fast_spi_master_server_t* srv) {
+    if (chanend_test_control_token_next_byte(srv->c_req)) {
+        // doorbell, the rings are scanned anyway
+        chanend_check_end_token(srv->c_req);
+        return true;
+    }
+    fast_spi_remote_slot_t* slot = server_free_slot(srv);
+    if (slot == NULL) {
+        return false;
+    }
+    server_recv_remote(srv, slot);
+    return true;
+}
+
+static void server_poll(fast_spi_master_server_t* srv) {
+    while (1) {
+        SELECT_RES(
+            CASE_THEN(srv->c_req, on_req),
+            DEFAULT_THEN(no_req)
+        ) {
+        on_req:
+            if (!server_recv(srv)) {
+                return;
+            }
+            continue;
+        no_req:
+            return;
+        }
+    }
+}
+
+// index < num_clients picks a local client, the rest pick a remote slot
+static bool server_pending(fast_spi_master_server_t* srv, size_t index, size_t* dev_id) {
+    if (index < srv->num_clients) {
+        fast_spi_client_t* client = srv->clients[index];
+        if (client->head == client->done) {
+            return false;
+        }
+        *dev_id = client->ring[client->done & (FAST_SPI_SERVER_QUEUE_LEN - 1)].dev_id;
+        return true;
+    }
+    fast_spi_remote_slot_t* slot = &srv->remote[index - srv->num_clients];
+    if (slot->reply_to == 0) {
+        return false;
+    }
+    *dev_id = slot->dev_id;
+    return true;
+}
+
+/*
+ * Oldest xfer of every client is a candidate, the ones for the current device
+ * go first so fast_spi_master_init_xfer runs as rarely as possible, the others
+ * get their turn in round robin order after FAST_SPI_SERVER_MAX_BATCH xfers.
+ */
+static int server_pick(fast_spi_master_server_t* srv) {
+    size_t num = srv->num_clients + FAST_SPI_SERVER_MAX_REMOTE;
+    size_t depth = 0;
+    int first = -1;
+    int same = -1;
+    for (size_t i = 0; i < num; ++i) {
+        size_t index = (srv->next + i) % num;
+        size_t dev_id;
+        if (!server_pending(srv, index, &dev_id)) {
+            continue;
+        }
+        if (index < srv->num_clients) {
+            depth += srv->clients[index]->head - srv->clients[index]->done;
+        } else {
+            depth += 1;
+        }
+        if (first < 0) {
+            first = index;
+        }
+        if (same < 0 && srv->devices[dev_id] == srv->current) {
+            same = index;
+        }
+    }
+    srv->queue_depth = depth;
+    if (depth > srv->max_queue_depth) {
+        srv->max_queue_depth = depth;
+    }
+    if (same >= 0 && (same == first || srv->batch < FAST_SPI_SERVER_MAX_BATCH)) {
+        ++srv->batch;
+        srv->next = (same + 1) % num;
+        return same;
+    }
+    srv->batch = 1;
+    if (first >= 0) {
+        srv->next = (first + 1) % num;
+    }
+    return first;
+}
+
+static void server_run(fast_spi_master_server_t* srv, size_t dev_id, uint8_t* tx_buf, uint8_t* rx_buf, size_t len) {
+    fast_spi_master_device_handle_t* dev = srv->devices[dev_id];
+    if (dev != srv->current) {
+        fast_spi_master_init_xfer(dev);
+        srv->current = dev;
+        ++srv->device_switches;
+    }
+    fast_spi_master_xfer(dev, tx_buf, rx_buf, len);
+}
+
+void fast_spi_master_server(fast_spi_master_server_t* srv) {
+    local_thread_mode_set_bits(thread_mode_high_priority);
+    while (1) {
+        server_poll(srv);
+        int index = server_pick(srv);
+        if (index < 0) {
+            // nothing queued (so every remote slot is free), paused until a doorbell or a remote request arrives
+            server_recv(srv);
+            continue;
+        }
+        if (index < srv->num_clients) {
+            fast_spi_client_t* client = srv->clients[index];
+            fast_spi_xfer_t* xfer = &client->ring[client->done & (FAST_SPI_SERVER_QUEUE_LEN - 1)];
+            server_run(srv, xfer->dev_id, xfer->tx_buf, xfer->rx_buf, xfer->len);
+            ++client->done;
+            chanend_set_dest(srv->c_reply, client->c);
+            chanend_out_end_token(srv->c_reply);
+        } else {
+            fast_spi_remote_slot_t* slot = &srv->remote[index - srv->num_clients];
+            server_run(srv, slot->dev_id,
+                slot->has_tx ? (uint8_t*)slot->tx_buf : NULL,
+                slot->has_rx ? (uint8_t*)slot->rx_buf : NULL,
+                slot->len
+            );
+            chanend_set_dest(srv->c_reply, slot->reply_to);
+            chanend_out_word(srv->c_reply, REMOTE_OK);
+            if (slot->has_rx) {
+                for (int i = 0; i < NUM_WORDS(slot->len); ++i) {
+                    chanend_out_word(srv->c_reply, slot->rx_buf[i]);
+                }
+            }
+            chanend_out_end_token(srv->c_reply);
+            slot->reply_to = 0;
+        }
+    }
+}
+
+bool fast_spi_client_init(fast_spi_client_t* client, fast_spi_master_server_t* srv) {
+    if (srv->num_clients == FAST_SPI_SERVER_MAX_CLIENTS) {
+        return false;
+    }
+    client->c = chanend_alloc();
+    if (client->c == 0) {
+        return false;
+    }
+    client->head = 0;
+    client->done = 0;
+    client->acked = 0;
+    chanend_set_dest(client->c, srv->c_req);
+    srv->clients[srv->num_clients++] = client;
+    return true;
+}
+
+void fast_spi_client_xfer_start(fast_spi_client_t* client, size_t dev_id, uint8_t* tx_buf, uint8_t* rx_buf, size_t len) {
+    if (client->head - client->acked == FAST_SPI_SERVER_QUEUE_LEN) {
+        chanend_check_end_token(client->c);
+        ++client->acked;
+    }
+    fast_spi_xfer_t* xfer = &client->ring[client->head & (FAST_SPI_SERVER_QUEUE_LEN - 1)];
+    xfer->dev_id = dev_id;
+    xfer->tx_buf = tx_buf;
+    xfer->rx_buf = rx_buf;
+    xfer->len = len;
+    // entry has to be in place before the server can see the new head
+    asm volatile("" ::: "memory");
+    ++client->head;
+    chanend_out_end_token(client->c);
+}
+
+void fast_spi_client_xfer_wait(fast_spi_client_t* client) {
+    while (client->acked != client->head) {
+        chanend_check_end_token(client->c);
+        ++client->acked;
+    }
+}
+
+void fast_spi_client_xfer(fast_spi_client_t* client, size_t dev_id, uint8_t* tx_buf, uint8_t* rx_buf, size_t len) {
+    fast_spi_client_xfer_start(client, dev_id, tx_buf, rx_buf, len);
+    fast_spi_client_xfer_wait(client);
+}
+
+size_t fast_spi_client_queue_depth(fast_spi_client_t* client) {
+    return client->head - client->done;
+}
+
+void fast_spi_remote_client_init(fast_spi_remote_client_t* client, chanend_t server_id, size_t num_devices) {
+    client->c = chanend_alloc();
+    chanend_set_dest(client->c, server_id);
+    client->num_devices = num_devices;
+}
+
+bool fast_spi_remote_client_xfer(fast_spi_remote_client_t* client, size_t dev_id, uint8_t* tx_buf, uint8_t* rx_buf, size_t len) {
+    uint32_t word;
+    if (dev_id >= client->num_devices || len == 0 || len > FAST_SPI_SERVER_REMOTE_MAX_LEN) {
+        return false;
+    }
+    chanend_out_word(client->c, client->c);
+    chanend_out_word(client->c, dev_id);
+    chanend_out_word(client->c, (tx_buf != NULL ? REMOTE_HAS_TX : 0) | (rx_buf != NULL ? REMOTE_HAS_RX : 0));
+    chanend_out_word(client->c, len);
+    if (tx_buf != NULL) {
+        for (size_t i = 0; i < len; i += 4) {
+            word = 0;
+            memcpy(&word, &tx_buf[i], len - i < 4 ? len - i : 4);
+            chanend_out_word(client->c, word);
+        }
+    }
+    chanend_out_end_token(client->c);
+    if (chanend_in_word(client->c) != REMOTE_OK) {
+        chanend_check_end_token(client->c);
+        return false;
+    }
+    if (rx_buf != NULL) {
+        for (size_t i = 0; i < len; i += 4) {
+            word = chanend_in_word(client->c);
+            memcpy(&rx_buf[i], &word, len - i < 4 ? len - i : 4);
+        }
+    }
+    chanend_check_end_token(client->c);
+    return true;
+}
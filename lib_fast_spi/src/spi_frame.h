@@ -0,0 +1,51 @@
+/*
+Word framing of the kernels, included by the .S files.
+
+FAST_SPI_FRAME follows fast_spi_frame_t, 0 (msb8) when not set. Buffers hold
+little endian words, the framing turns them into port order (first bit on
+the wire in bit 0) and back:
+    msb8:   bitrev + byterev
+    msb16:  bitrev, the 2 halves of every word swapped
+    msb32:  bitrev
+    lsb:    nothing, a buffer goes out as it is in memory for any word width
+
+The master kernels get the msb16 half swap for free: zipped words have one
+half in each register, FRAME_ZIP/FRAME_LO/FRAME_HI swap which register a
+half goes out from or comes in to. The slave ports take a whole word at a
+time, so FRAME_SWAP16 costs 2 more bundles there.
+*/
+
+#ifndef FAST_SPI_FRAME
+#define FAST_SPI_FRAME 0
+#endif
+
+#if FAST_SPI_FRAME == 3
+    #define FRAME_BITREV(d, s)      add d, s, 0
+#else
+    #define FRAME_BITREV(d, s)      bitrev d, s
+#endif
+
+#if FAST_SPI_FRAME == 0
+    #define FRAME_BYTEREV(d, s)     byterev d, s
+#else
+    #define FRAME_BYTEREV(d, s)     add d, s, 0
+#endif
+
+// zip d, e (d = e) puts the first half on the wire into e, FRAME_LO(a, b) is the first word in for unzip b, a
+#if FAST_SPI_FRAME == 1
+    #define FRAME_ZIP(d, e)         zip e, d, 0
+    #define FRAME_LO(a, b)          b
+    #define FRAME_HI(a, b)          a
+#else
+    #define FRAME_ZIP(d, e)         zip d, e, 0
+    #define FRAME_LO(a, b)          a
+    #define FRAME_HI(a, b)          b
+#endif
+
+// swap the halves of x, t is trashed
+.macro FRAME_SWAP16 x, t
+#if FAST_SPI_FRAME == 1
+    { shl \t, \x, 16            ; shr \x, \x, 16            }
+    { or \x, \x, \t             ; nop                       }
+#endif
+.endm